@@ -110,8 +110,7 @@ int main(int argc, const char** argv)
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
         r.draw(pos_id, ind_id, rst::Primitive::Triangle);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
+        cv::Mat image = r.frame_buffer().image();
 
         cv::imwrite(filename, image);
 
@@ -127,8 +126,7 @@ int main(int argc, const char** argv)
 
         r.draw(pos_id, ind_id, rst::Primitive::Triangle);
 
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
+        cv::Mat image = r.frame_buffer().image();
         cv::imshow("image", image);
         key = cv::waitKey(10);
 
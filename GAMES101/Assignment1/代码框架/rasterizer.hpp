@@ -5,6 +5,7 @@
 #pragma once
 
 #include "Triangle.hpp"
+#include "framebuffer.hpp"
 #include <algorithm>
 #include <eigen3/Eigen/Eigen>
 using namespace Eigen;
@@ -64,7 +65,10 @@ class rasterizer
 
     void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, Primitive type);
 
-    std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+    // Storage of the color buffer, BGR8 by default. Clears the buffer.
+    void set_color_format(ColorFormat format);
+
+    color_buffer& frame_buffer() { return frame_buf; }
 
   private:
     void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
@@ -78,8 +82,8 @@ class rasterizer
     std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
     std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
 
-    std::vector<Eigen::Vector3f> frame_buf;
-    std::vector<float> depth_buf;
+    color_buffer frame_buf;
+    depth_buffer depth_buf;
     int get_index(int x, int y);
 
     int width, height;
@@ -108,6 +108,11 @@ int main(int argc, const char** argv)
     auto ind_id = r.load_indices(ind);
     auto col_id = r.load_colors(cols);
 
+    // 两个三角形都是逆时针，正面朝向相机
+    r.set_face_culling(rst::Cull::Back);
+    // 4x MSAA 抗锯齿
+    r.set_msaa(4);
+
     int key = 0;
     int frame_count = 0;
 
@@ -120,12 +125,14 @@ int main(int argc, const char** argv)
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
         r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        cv::Mat image = r.frame_buffer().image();
 
         cv::imwrite(filename, image);
 
+        const auto& culled = r.culling_stats();
+        std::cout << "culled " << culled.frustum + culled.back_face << " of " << culled.submitted
+                  << " triangles (frustum " << culled.frustum << ", back-face " << culled.back_face << ")\n";
+
         return 0;
     }
 
@@ -139,9 +146,7 @@ int main(int argc, const char** argv)
 
         r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
 
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        cv::Mat image = r.frame_buffer().image();
         cv::imshow("image", image);
         key = cv::waitKey(10);
 
@@ -4,6 +4,7 @@
 //
 
 #include <algorithm>
+#include <stdexcept>
 #include <vector>
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
@@ -15,6 +16,24 @@ rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3
     auto id = get_next_id();
     pos_buf.emplace(id, positions);
 
+    // Bounding sphere centered on the bounding box, for frustum culling of the whole buffer
+    Eigen::Vector4f bounds = Eigen::Vector4f::Zero();
+    if (!positions.empty())
+    {
+        Eigen::Vector3f lo = positions[0], hi = positions[0];
+        for (const auto& p : positions)
+        {
+            lo = lo.cwiseMin(p);
+            hi = hi.cwiseMax(p);
+        }
+        Eigen::Vector3f center = (lo + hi) / 2;
+        float radius = 0;
+        for (const auto& p : positions)
+            radius = std::max(radius, (p - center).norm());
+        bounds << center, radius;
+    }
+    pos_bounds.emplace(id, bounds);
+
     return {id};
 }
 
@@ -40,7 +59,7 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
 }
 
 
-static bool insideTriangle(int x, int y, const Vector3f* _v)
+static bool insideTriangle(float x, float y, const Vector3f* _v)
 {   
     // TODO : Implement this function to check if the point (x, y) is inside the triangle represented by _v[0], _v[1], _v[2]
     Vector3f v[3];
@@ -73,6 +92,14 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
     float f2 = (50 + 0.1) / 2.0;
 
     Eigen::Matrix4f mvp = projection * view * model;
+
+    stats.submitted += ind.size();
+    if (frustum_culling && sphere_outside_frustum(pos_bounds[pos_buffer.pos_id], view * model))
+    {
+        stats.frustum += ind.size();
+        return;
+    }
+
     for (auto& i : ind)
     {
         Triangle t;
@@ -81,6 +108,17 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
                 mvp * to_vec4(buf[i[1]], 1.0f),
                 mvp * to_vec4(buf[i[2]], 1.0f)
         };
+        //Culling
+        if (frustum_outcode(v[0]) & frustum_outcode(v[1]) & frustum_outcode(v[2]))
+        {
+            stats.frustum++;
+            continue;
+        }
+        if (face_culling != Cull::None && face_culled(v[0], v[1], v[2]))
+        {
+            stats.back_face++;
+            continue;
+        }
         //Homogeneous division
         for (auto& vec : v) {
             vec /= vec.w();
@@ -110,6 +148,56 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
 
         rasterize_triangle(t);
     }
+
+    if (msaa_samples > 1)
+        resolve();
+}
+
+// True if a bounding sphere (center, radius), in model space, lies entirely behind the camera or
+// outside one side of the view frustum. The planes are rows of the projection combined as in
+// frustum_outcode(), so they live in view space, where the sphere is moved to with its radius
+// scaled by the largest scale factor of mv.
+bool rst::rasterizer::sphere_outside_frustum(const Eigen::Vector4f& sphere, const Eigen::Matrix4f& mv) const
+{
+    Eigen::Vector4f center = mv * to_vec4(sphere.head<3>(), 1.0f);
+    float radius = sphere.w() * mv.topLeftCorner<3, 3>().colwise().norm().maxCoeff();
+
+    Eigen::Vector4f w = w_sign * projection.row(3).transpose();
+    Eigen::Vector4f x = projection.row(0).transpose();
+    Eigen::Vector4f y = projection.row(1).transpose();
+    const Eigen::Vector4f planes[5] = {w, w + x, w - x, w + y, w - y};
+    for (const auto& plane : planes)
+    {
+        if (plane.dot(center) < -radius * plane.head<3>().norm())
+            return true;
+    }
+    return false;
+}
+
+// One bit per side of the view frustum that v (in clip space) lies outside of, and one for being
+// behind the camera. A triangle whose vertices share a bit is not visible.
+int rst::rasterizer::frustum_outcode(const Eigen::Vector4f& v) const
+{
+    float w = w_sign * v.w();
+    int code = w <= 0 ? 1 : 0;
+    code |= (v.x() < -w ? 2 : 0) | (v.x() > w ? 4 : 0);
+    code |= (v.y() < -w ? 8 : 0) | (v.y() > w ? 16 : 0);
+    return code;
+}
+
+// Face culling of a triangle given in clip space. With w' = w_sign * w, the determinant of the rows
+// (x, y, w') is the screen-space signed area times w'0 * w'1 * w'2, so it is positive for a
+// counter-clockwise triangle in front of the camera.
+bool rst::rasterizer::face_culled(const Eigen::Vector4f& v0, const Eigen::Vector4f& v1, const Eigen::Vector4f& v2) const
+{
+    Eigen::Matrix3f m;
+    m << v0.x(), v0.y(), w_sign * v0.w(),
+         v1.x(), v1.y(), w_sign * v1.w(),
+         v2.x(), v2.y(), w_sign * v2.w();
+    float facing = m.determinant();
+    if (facing == 0)
+        return true;
+    return face_culling == Cull::Back ? facing < 0 : facing > 0;
 }
 
 //Screen space rasterization
@@ -117,38 +205,246 @@ void rst::rasterizer::rasterize_triangle(const Triangle& t) {
     auto v = t.toVector4();
 
     // TODO : Find out the bounding box of current triangle.
+    // Pixels with a sample point inside it, the samples lying within reach of the pixel's point (x, y)
+    float reach = msaa_samples > 1 ? 0.5f : 0.0f;
     int xmin,xmax,ymin,ymax;
-    xmin = std::min({v[0].x(), v[1].x(), v[2].x()});
-    xmax = std::max({v[0].x(), v[1].x(), v[2].x()});
-    ymin = std::min({v[0].y(), v[1].y(), v[2].y()});
-    ymax = std::max({v[0].y(), v[1].y(), v[2].y()});
+    xmin = std::ceil(std::min({v[0].x(), v[1].x(), v[2].x()}) - reach);
+    xmax = std::floor(std::max({v[0].x(), v[1].x(), v[2].x()}) + reach) + 1;
+    ymin = std::ceil(std::min({v[0].y(), v[1].y(), v[2].y()}) - reach);
+    ymax = std::floor(std::max({v[0].y(), v[1].y(), v[2].y()}) + reach) + 1;
+    xmin = std::max(xmin, 0);
+    ymin = std::max(ymin, 0);
+    xmax = std::min(xmax, width);
+    ymax = std::min(ymax, height);
+
+    // Hierarchical Z: z is interpolated linearly, so no pixel of the triangle is nearer than its
+    // nearest vertex and an 8x8 block whose farthest depth is not behind that can be skipped
+    float tri_min_z = std::min({v[0].z(), v[1].z(), v[2].z()});
+
+    // MSAA setup: edge functions E_i(x, y) = edge_a[i] * x + edge_b[i] * y + edge_c[i], positive inside,
+    // and the depth plane z(x, y) through the vertices. Both are linear, so their change from the
+    // point of a pixel to each of its samples is the same for all pixels.
+    float edge_a[3], edge_b[3], edge_c[3];
+    float dz_dx = 0, dz_dy = 0;
+    float edge_delta[8][3], z_delta[8];
+    float min_delta[3], max_delta[3];
+    int full_mask = (1 << msaa_samples) - 1;
+    if (msaa_samples > 1)
+    {
+        float area = (v[1].x() - v[0].x()) * (v[2].y() - v[0].y()) - (v[2].x() - v[0].x()) * (v[1].y() - v[0].y());
+        if (area == 0)
+            return;
+        float sign = area > 0 ? 1.0f : -1.0f;
+        for (int i = 0; i < 3; i++)
+        {
+            const Eigen::Vector4f& p = v[(i + 1) % 3];
+            const Eigen::Vector4f& q = v[(i + 2) % 3];
+            edge_a[i] = sign * (p.y() - q.y());
+            edge_b[i] = sign * (q.x() - p.x());
+            edge_c[i] = sign * (p.x() * q.y() - q.x() * p.y());
+        }
+        dz_dx = ((v[1].z() - v[0].z()) * (v[2].y() - v[0].y()) - (v[2].z() - v[0].z()) * (v[1].y() - v[0].y())) / area;
+        dz_dy = ((v[1].x() - v[0].x()) * (v[2].z() - v[0].z()) - (v[2].x() - v[0].x()) * (v[1].z() - v[0].z())) / area;
+
+        for (int i = 0; i < 3; i++)
+        {
+            min_delta[i] = std::numeric_limits<float>::infinity();
+            max_delta[i] = -std::numeric_limits<float>::infinity();
+        }
+        for (int s = 0; s < msaa_samples; s++)
+        {
+            const Eigen::Vector2f& offset = sample_offsets[s];
+            for (int i = 0; i < 3; i++)
+            {
+                edge_delta[s][i] = edge_a[i] * offset.x() + edge_b[i] * offset.y();
+                min_delta[i] = std::min(min_delta[i], edge_delta[s][i]);
+                max_delta[i] = std::max(max_delta[i], edge_delta[s][i]);
+            }
+            z_delta[s] = dz_dx * offset.x() + dz_dy * offset.y();
+        }
+    }
 
     // iterate through the pixel and find if the current pixel is inside the triangle
-    for(int x= xmin;x<xmax;x++)
+    for (int by = ymin / hiz_block; by * hiz_block < ymax; by++)
+    {
+        for (int bx = xmin / hiz_block; bx * hiz_block < xmax; bx++)
+        {
+            if (tri_min_z >= hiz_buf[by * hiz_width + bx])
+                continue;
+            if (msaa_samples > 1 && depth_cleared[by * hiz_width + bx])
+                fast_clear_depth(bx, by);
+
+            bool written = false;
+            for(int x = std::max(xmin, bx * hiz_block); x < std::min(xmax, (bx + 1) * hiz_block); x++)
+            {
+                for(int y = std::max(ymin, by * hiz_block); y < std::min(ymax, (by + 1) * hiz_block); y++)
+                {
+                    int ind = get_index(x, y);
+                    if (msaa_samples > 1)
+                    {
+                        // Coverage and depth test per sample, then at most one shading evaluation
+                        float e[3];
+                        bool outside = false, inside = true;
+                        for (int i = 0; i < 3; i++)
+                        {
+                            e[i] = edge_a[i] * x + edge_b[i] * y + edge_c[i];
+                            outside |= e[i] + max_delta[i] < 0;
+                            inside &= e[i] + min_delta[i] >= 0;
+                        }
+                        if (outside)
+                            continue;
+
+                        float z_pixel = v[0].z() + dz_dx * (x - v[0].x()) + dz_dy * (y - v[0].y());
+                        int first_sample = ind * msaa_samples;
+                        int mask = inside ? full_mask : 0;
+                        float z[8];
+                        for (int s = 0; s < msaa_samples; s++)
+                        {
+                            if (!inside && e[0] + edge_delta[s][0] >= 0 && e[1] + edge_delta[s][1] >= 0 && e[2] + edge_delta[s][2] >= 0)
+                                mask |= 1 << s;
+                            z[s] = z_pixel + z_delta[s];
+                        }
+                        mask = depth_buf.test_and_set(first_sample, msaa_samples, z, mask);
+                        if (!mask)
+                            continue;
+
+                        // A pixel whose samples all have one color keeps it in frame_buf only; its
+                        // samples are only stored once a triangle covers part of it
+                        Eigen::Vector3f color = t.getColor();
+                        Eigen::Vector3f* samples = &sample_buf[first_sample];
+                        if (mask == full_mask)
+                        {
+                            frame_buf.set(ind, color);
+                            pixel_split[ind] = 0;
+                        }
+                        else
+                        {
+                            if (!pixel_split[ind])
+                            {
+                                std::fill(samples, samples + msaa_samples, frame_buf.get(ind));
+                                pixel_split[ind] = 1;
+                            }
+                            for (int s = 0; s < msaa_samples; s++)
+                            {
+                                if (mask & (1 << s))
+                                    samples[s] = color;
+                            }
+                        }
+                        written = true;
+                        continue;
+                    }
+
+                    // TODO : Iterate through the pixel and find if the current pixel is inside the triangle.
+                    if(insideTriangle(x, y, t.v))
+                    {
+                        // If so, use the following code to get the interpolated z value.
+                        auto[alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
+                        float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
+                        float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
+                        z_interpolated *= w_reciprocal;
+
+                        // TODO : Set the current pixel (use the set_pixel function) to the color of the triangle (use getColor function) if it should be painted.
+                        if(depth_buf.nearer(ind, z_interpolated))
+                        {
+                            depth_buf.set(ind, z_interpolated);
+                            set_pixel(Eigen::Vector3f(x, y, 0), t.getColor());
+                            written = true;
+                        }
+                    }
+                }
+            }
+            if (written)
+            {
+                update_hiz(bx, by);
+                resolve_pending[by * hiz_width + bx] = 1;
+            }
+        }
+    }
+}
+
+// Recomputes the farthest depth of Hi-Z block (bx, by) after depth writes
+void rst::rasterizer::update_hiz(int bx, int by)
+{
+    int x0 = bx * hiz_block, x1 = std::min((bx + 1) * hiz_block, width);
+    float max_z = -std::numeric_limits<float>::infinity();
+    for (int y = by * hiz_block; y < std::min((by + 1) * hiz_block, height); y++)
     {
-        for(int y= ymin;y<ymax;y++)
+        // The samples of a row of the block are contiguous
+        max_z = std::max(max_z, depth_buf.max(get_index(x0, y) * msaa_samples, (x1 - x0) * msaa_samples));
+    }
+    hiz_buf[by * hiz_width + bx] = max_z;
+}
+
+// Fast clear: resets the depth samples of Hi-Z block (bx, by) left pending by clear()
+void rst::rasterizer::fast_clear_depth(int bx, int by)
+{
+    int x0 = bx * hiz_block, x1 = std::min((bx + 1) * hiz_block, width);
+    for (int y = by * hiz_block; y < std::min((by + 1) * hiz_block, height); y++)
+    {
+        depth_buf.fill(get_index(x0, y) * msaa_samples, (x1 - x0) * msaa_samples, std::numeric_limits<float>::infinity());
+    }
+    depth_cleared[by * hiz_width + bx] = 0;
+}
+
+// MSAA resolve: averages the samples of the split pixels of every block written since the last
+// resolve into frame_buf
+void rst::rasterizer::resolve()
+{
+    float weight = 1.0f / msaa_samples;
+    for (int by = 0; by * hiz_block < height; by++)
+    {
+        for (int bx = 0; bx < hiz_width; bx++)
         {
-            // TODO : Iterate through the pixel and find if the current pixel is inside the triangle.
-            if(insideTriangle(x, y, t.v))
+            if (!resolve_pending[by * hiz_width + bx])
+                continue;
+            resolve_pending[by * hiz_width + bx] = 0;
+            for (int y = by * hiz_block; y < std::min((by + 1) * hiz_block, height); y++)
             {
-                // If so, use the following code to get the interpolated z value.
-                auto[alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-                float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                z_interpolated *= w_reciprocal;
-
-                // TODO : Set the current pixel (use the set_pixel function) to the color of the triangle (use getColor function) if it should be painted.
-                int ind = get_index(x, y);
-                if(depth_buf[ind] > z_interpolated)
+                for (int x = bx * hiz_block; x < std::min((bx + 1) * hiz_block, width); x++)
                 {
-                    depth_buf[ind] = z_interpolated;
-                    set_pixel(Eigen::Vector3f(x, y, 0), t.getColor());
+                    int ind = get_index(x, y);
+                    if (!pixel_split[ind])
+                        continue;
+                    Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+                    for (int s = 0; s < msaa_samples; s++)
+                        sum += sample_buf[ind * msaa_samples + s];
+                    frame_buf.set(ind, sum * weight);
                 }
             }
         }
     }
 }
 
+void rst::rasterizer::set_msaa(int samples)
+{
+    // Standard sample patterns, in 1/16 pixel
+    static const std::vector<Eigen::Vector2f> patterns[] = {
+        {{0, 0}},
+        {{4, 4}, {-4, -4}},
+        {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}},
+        {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}}
+    };
+    int pattern;
+    switch (samples)
+    {
+        case 1: pattern = 0; break;
+        case 2: pattern = 1; break;
+        case 4: pattern = 2; break;
+        case 8: pattern = 3; break;
+        default: throw std::runtime_error("MSAA supports 1, 2, 4 or 8 samples per pixel");
+    }
+
+    msaa_samples = samples;
+    sample_offsets.clear();
+    for (const auto& offset : patterns[pattern])
+        sample_offsets.push_back(offset / 16.0f);
+
+    depth_buf.reset(width * height * samples, depth_buf.format());
+    sample_buf.resize(samples > 1 ? width * height * samples : 0);
+    pixel_split.assign(samples > 1 ? width * height : 0, 0);
+    clear(rst::Buffers::Color | rst::Buffers::Depth);
+}
+
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
 {
     model = m;
@@ -162,24 +458,36 @@ void rst::rasterizer::set_view(const Eigen::Matrix4f& v)
 void rst::rasterizer::set_projection(const Eigen::Matrix4f& p)
 {
     projection = p;
+    w_sign = projection(3, 2) > 0 ? -1.0f : 1.0f;
 }
 
 void rst::rasterizer::clear(rst::Buffers buff)
 {
+    stats = {};
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        frame_buf.fill(Eigen::Vector3f{0, 0, 0});
+        std::fill(pixel_split.begin(), pixel_split.end(), 0);
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
-        std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        // With MSAA the depth samples of a block are only reset once something is drawn into it
+        if (msaa_samples > 1)
+            std::fill(depth_cleared.begin(), depth_cleared.end(), 1);
+        else
+            depth_buf.fill(0, depth_buf.size(), std::numeric_limits<float>::infinity());
+        std::fill(hiz_buf.begin(), hiz_buf.end(), std::numeric_limits<float>::infinity());
     }
 }
 
-rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
+rst::rasterizer::rasterizer(int w, int h) : frame_buf(w, h), width(w), height(h)
 {
-    frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
+    depth_buf.reset(w * h, DepthFormat::Float);
+
+    hiz_width = (w + hiz_block - 1) / hiz_block;
+    hiz_buf.assign(hiz_width * ((h + hiz_block - 1) / hiz_block), std::numeric_limits<float>::infinity());
+    resolve_pending.resize(hiz_buf.size());
+    depth_cleared.resize(hiz_buf.size());
 }
 
 int rst::rasterizer::get_index(int x, int y)
@@ -191,8 +499,21 @@ void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vecto
 {
     //old index: auto ind = point.y() + point.x() * width;
     auto ind = (height-1-point.y())*width + point.x();
-    frame_buf[ind] = color;
+    frame_buf.set(ind, color);
+
+}
 
+void rst::rasterizer::set_color_format(ColorFormat format)
+{
+    frame_buf = color_buffer(width, height, format);
+    std::fill(pixel_split.begin(), pixel_split.end(), 0);
+}
+
+void rst::rasterizer::set_depth_format(DepthFormat format)
+{
+    depth_buf.reset(width * height * msaa_samples, format);
+    std::fill(hiz_buf.begin(), hiz_buf.end(), std::numeric_limits<float>::infinity());
+    std::fill(depth_cleared.begin(), depth_cleared.end(), 0);
 }
 
 // clang-format on
\ No newline at end of file
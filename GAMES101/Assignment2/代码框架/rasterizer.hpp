@@ -6,6 +6,9 @@
 
 #include <eigen3/Eigen/Eigen>
 #include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "framebuffer.hpp"
 #include "global.hpp"
 #include "Triangle.hpp"
 using namespace Eigen;
@@ -34,6 +37,21 @@ namespace rst
         Triangle
     };
 
+    enum class Cull
+    {
+        None,
+        Back,  // triangles wound clockwise on screen (with y up)
+        Front  // triangles wound counter-clockwise on screen
+    };
+
+    // Triangles submitted to and rejected by draw() since the last clear()
+    struct cull_stats
+    {
+        int submitted = 0;
+        int frustum = 0;    // outside the view frustum, whole meshes by their bounding sphere or one by one
+        int back_face = 0;  // removed by face culling, including degenerate triangles
+    };
+
     /*
      * For the curious : The draw function takes two buffer id's as its arguments. These two structs
      * make sure that if you mix up with their orders, the compiler won't compile it.
@@ -68,16 +86,41 @@ namespace rst
 
         void set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color);
 
+        // Face culling happens right after the projection; none by default.
+        void set_face_culling(Cull mode) { face_culling = mode; }
+
+        // Whether draw() first tests the bounding sphere of the whole position buffer against the
+        // view frustum; on by default. Triangles are always rejected one by one.
+        void set_frustum_culling(bool enable) { frustum_culling = enable; }
+
+        const cull_stats& culling_stats() const { return stats; }
+
+        // Multisample anti-aliasing with 1 (off), 2, 4 or 8 samples per pixel. Coverage and depth are
+        // tested per sample but a triangle is shaded once per pixel, and draw() resolves the samples
+        // into frame_buffer(). Clears the buffers.
+        void set_msaa(int samples);
+
         void clear(Buffers buff);
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // Storage of the color and depth buffers, BGR8 and Float by default. Clears the buffer.
+        void set_color_format(ColorFormat format);
+        void set_depth_format(DepthFormat format);
+
+        color_buffer& frame_buffer() { return frame_buf; }
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
+        bool sphere_outside_frustum(const Eigen::Vector4f& sphere, const Eigen::Matrix4f& mv) const;
+        int frustum_outcode(const Eigen::Vector4f& v) const;
+        bool face_culled(const Eigen::Vector4f& v0, const Eigen::Vector4f& v1, const Eigen::Vector4f& v2) const;
+
         void rasterize_triangle(const Triangle& t);
+        void update_hiz(int bx, int by);
+        void fast_clear_depth(int bx, int by);
+        void resolve();
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -87,16 +130,44 @@ namespace rst
         Eigen::Matrix4f projection;
 
         std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
+        // Bounding sphere (center, radius) of each position buffer, in model space
+        std::map<int, Eigen::Vector4f> pos_bounds;
         std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
         std::map<int, std::vector<Eigen::Vector3f>> col_buf;
 
-        std::vector<Eigen::Vector3f> frame_buf;
+        color_buffer frame_buf;
 
-        std::vector<float> depth_buf;
+        // msaa_samples depths per pixel, the samples of a pixel being contiguous
+        depth_buffer depth_buf;
         int get_index(int x, int y);
 
+        // Hierarchical Z: farthest depth_buf value of each hiz_block x hiz_block screen block
+        static constexpr int hiz_block = 8;
+        int hiz_width;
+        std::vector<float> hiz_buf;
+
+        // MSAA: the samples of pixel (x, y) lie at (x, y) + sample_offsets[i]. A pixel whose samples
+        // all have the same color keeps it in frame_buf; once a triangle covers only part of it, it is
+        // split and sample_buf (laid out like depth_buf) holds its sample colors until resolve()
+        // averages them into frame_buf. Unused with a single sample.
+        int msaa_samples = 1;
+        std::vector<Eigen::Vector2f> sample_offsets{{0.0f, 0.0f}};
+        std::vector<Eigen::Vector3f> sample_buf;
+        std::vector<uint8_t> pixel_split;
+        // Per Hi-Z block: samples written since the last resolve(), and depth samples not yet reset
+        // since the last clear()
+        std::vector<uint8_t> resolve_pending;
+        std::vector<uint8_t> depth_cleared;
+
         int width, height;
 
+        // w_sign * w is the distance in front of the camera: the projection of this assignment maps
+        // view-space z, which is negative in front of the camera, to w
+        float w_sign = 1.0f;
+        Cull face_culling = Cull::None;
+        bool frustum_culling = true;
+        cull_stats stats;
+
         int next_id = 0;
         int get_next_id() { return next_id++; }
     };
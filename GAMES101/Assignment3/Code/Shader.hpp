@@ -5,9 +5,27 @@
 #ifndef RASTERIZER_SHADER_H
 #define RASTERIZER_SHADER_H
 #include <eigen3/Eigen/Eigen>
+#include <limits>
+#include <vector>
+#include "ShadowMap.hpp"
 #include "Texture.hpp"
 
 
+// Point light in view space, falling off with the squared distance. Shading ignores it beyond
+// radius, which lets the rasterizer cull it from the screen tiles it cannot reach.
+struct light
+{
+    Eigen::Vector3f position;
+    Eigen::Vector3f intensity;
+    float radius = std::numeric_limits<float>::infinity();
+};
+
+// Distance at which an inverse-square light of the given intensity falls below cutoff
+inline float attenuation_radius(const Eigen::Vector3f& intensity, float cutoff)
+{
+    return std::sqrt(intensity.maxCoeff() / cutoff);
+}
+
 struct fragment_shader_payload
 {
     fragment_shader_payload()
@@ -24,8 +42,48 @@ struct fragment_shader_payload
     Eigen::Vector3f normal;
     Eigen::Vector2f tex_coords;
     Texture* texture;
+    // Lights of the rasterizer, null if it has none, and the indices of those that can reach the
+    // fragment's screen tile, null if every light can
+    const std::vector<light>* lights = nullptr;
+    const std::vector<int>* tile_lights = nullptr;
+    // Shadow map i belongs to light i, looked up with view-space positions; null if the rasterizer
+    // has none
+    const std::vector<ShadowMap>* shadow_maps = nullptr;
+};
+
+// Structure-of-arrays attributes of one lane per pixel of a 2x2 quad
+using quad1f = Eigen::Array4f;
+using quad2f = Eigen::Array<float, 4, 2>;
+using quad3f = Eigen::Array<float, 4, 3>;
+
+// Payload of a quad fragment shader. Lane i is pixel (x + (i & 1), y + (i >> 1)) of the quad, each
+// column holds one component over the four lanes. Lanes the triangle does not cover are helper lanes:
+// their attributes are extrapolated from the triangle, so differences across the quad are
+// screen-space derivatives (see quad_ddx / quad_ddy), but their colors are discarded.
+struct fragment_quad_payload
+{
+    quad3f view_pos;
+    quad3f color;
+    quad3f normal;
+    quad2f tex_coords;
+    Texture* texture = nullptr;
+    // As in fragment_shader_payload
+    const std::vector<light>* lights = nullptr;
+    const std::vector<int>* tile_lights = nullptr;
+    const std::vector<ShadowMap>* shadow_maps = nullptr;
 };
 
+// Per-lane derivative of a quad value along +x and +y, one difference per row / column of the quad
+inline quad1f quad_ddx(const quad1f& v)
+{
+    return quad1f(v[1] - v[0], v[1] - v[0], v[3] - v[2], v[3] - v[2]);
+}
+
+inline quad1f quad_ddy(const quad1f& v)
+{
+    return quad1f(v[2] - v[0], v[3] - v[1], v[2] - v[0], v[3] - v[1]);
+}
+
 struct vertex_shader_payload
 {
     Eigen::Vector3f position;
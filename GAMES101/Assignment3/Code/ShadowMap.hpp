@@ -0,0 +1,109 @@
+//
+// Depth map rendered from a light, looked up with percentage-closer filtering.
+//
+
+#ifndef RASTERIZER_SHADOWMAP_H
+#define RASTERIZER_SHADOWMAP_H
+#include <eigen3/Eigen/Eigen>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+class ShadowMap{
+private:
+    int width = 0, height = 0;
+    // Depth of the nearest surface seen from the light, per texel, rows from the bottom up
+    std::vector<float> depths;
+    // From the lookup space to the screen space of the light's depth pass, before the division by
+    // w: x and y in texels, z the depth the pass stores
+    Eigen::Matrix4f to_map = Eigen::Matrix4f::Identity();
+    // Position of the light in the lookup space
+    Eigen::Vector3f light_pos = Eigen::Vector3f::Zero();
+
+    int pcf_radius = 1;
+    float depth_bias = 0.02f;
+    float normal_offset = 0.02f;
+
+    // Fraction of the (2 * pcf_radius + 1)^2 bilinear taps around texel position (x, y) at which z
+    // is not behind the stored depth. Each tap compares the four texels around it and blends the
+    // results bilinearly, so the taps together cover a (2 * pcf_radius + 2)^2 block of texels whose
+    // border rows and columns are weighted by the fractional position. Texels off the map are lit.
+    float filter(float x, float y, float z) const
+    {
+        x -= 0.5f;
+        y -= 0.5f;
+        float x_floor = std::floor(x), y_floor = std::floor(y);
+        float fx = x - x_floor, fy = y - y_floor;
+        int x0 = (int)x_floor - pcf_radius, y0 = (int)y_floor - pcf_radius;
+        int n = 2 * pcf_radius + 2;
+
+        // Weighted count of the lit texels of row ty of the block
+        auto row_lit = [&](int ty) {
+            if (ty < 0 || ty >= height)
+                return (float)(n - 1);
+            const float* row = &depths[(size_t)ty * width];
+            if (x0 >= 0 && x0 + n <= width)
+            {
+                row += x0;
+                float lit = (z <= row[0]) * (1 - fx) + (z <= row[n - 1]) * fx;
+                for (int i = 1; i < n - 1; ++i)
+                    lit += z <= row[i];
+                return lit;
+            }
+            float lit = 0;
+            for (int i = 0; i < n; ++i)
+            {
+                int tx = x0 + i;
+                float wx = i == 0 ? 1 - fx : i == n - 1 ? fx : 1;
+                if (tx < 0 || tx >= width || z <= row[tx])
+                    lit += wx;
+            }
+            return lit;
+        };
+
+        float lit = row_lit(y0) * (1 - fy) + row_lit(y0 + n - 1) * fy;
+        for (int j = 1; j < n - 1; ++j)
+            lit += row_lit(y0 + j);
+        return lit / (float)((n - 1) * (n - 1));
+    }
+
+public:
+    ShadowMap() = default;
+
+    ShadowMap(int w, int h, std::vector<float> depth, const Eigen::Matrix4f& lookup_to_map, const Eigen::Vector3f& light)
+        : width(w), height(h), depths(std::move(depth)), to_map(lookup_to_map), light_pos(light) {}
+
+    // 0 compares one bilinear tap, for hard shadows; larger radii soften the shadow edges over
+    // about 2 * radius + 1 texels
+    void setPcfRadius(int radius) { pcf_radius = std::max(0, radius); }
+
+    // Against shadow acne, the lookup point is moved normal_offset along the surface normal and
+    // then depth_bias towards the light, both in the units of the lookup space
+    void setBias(float depth, float normal)
+    {
+        depth_bias = depth;
+        normal_offset = normal;
+    }
+
+    // Fraction of the light reaching point, given with its unit normal in the lookup space:
+    // 1 fully lit, 0 fully in shadow
+    float getVisibility(const Eigen::Vector3f& point, const Eigen::Vector3f& normal) const
+    {
+        Eigen::Vector3f p = point + normal_offset * normal;
+        p += depth_bias * (light_pos - p).normalized();
+        Eigen::Vector4f m = to_map * p.homogeneous();
+        return filter(m.x() / m.w(), m.y() / m.w(), m.z() / m.w());
+    }
+
+    // Four lookups at once, one per row of point and normal. Rows outside lanes are skipped and
+    // come back as 1, e.g. for lanes the light does not reach anyway.
+    Eigen::Array4f getVisibility(const Eigen::Array<float, 4, 3>& point, const Eigen::Array<float, 4, 3>& normal,
+                                 const Eigen::Array<bool, 4, 1>& lanes = Eigen::Array<bool, 4, 1>::Constant(true)) const
+    {
+        Eigen::Array4f visibility = Eigen::Array4f::Ones();
+        for (int i = 0; i < 4; ++i)
+            if (lanes[i])
+                visibility[i] = getVisibility(Eigen::Vector3f(point.row(i).transpose()), Eigen::Vector3f(normal.row(i).transpose()));
+        return visibility;
+    }
+};
+#endif //RASTERIZER_SHADOWMAP_H
@@ -7,28 +7,272 @@
 #include "global.hpp"
 #include <eigen3/Eigen/Eigen>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
 class Texture{
 private:
-    cv::Mat image_data;
+    // One level of the mip pyramid. Texels are RGBA8 and stored in 4x4 tiles of 64 bytes, so a
+    // bilinear footprint, and the footprints of neighbouring pixels, mostly fall in one cache line.
+    struct mip_level
+    {
+        int width, height;
+        int tiles_x;
+        std::vector<std::array<uint8_t, 4>> texels;
+
+        const std::array<uint8_t, 4>& at(int x, int y) const
+        {
+            return texels[((y >> 2) * tiles_x + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3)];
+        }
+        std::array<uint8_t, 4>& at(int x, int y)
+        {
+            return texels[((y >> 2) * tiles_x + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3)];
+        }
+
+        Eigen::Array4f texel(int x, int y) const
+        {
+            const auto& t = at(x, y);
+            return Eigen::Array4f(t[0], t[1], t[2], t[3]);
+        }
+
+        void resize(int w, int h)
+        {
+            width = w;
+            height = h;
+            tiles_x = (w + 3) / 4;
+            texels.assign((size_t)tiles_x * ((h + 3) / 4) * 16, {0, 0, 0, 0});
+        }
+    };
+
+    // levels[0] is the image, each further level halves it down to 1x1
+    std::vector<mip_level> levels;
+
+    // Per texel of levels[0]: the height |color| and its forward differences towards the next
+    // texel in +u and in +v, i.e. (h(u, v), h(u + 1/w, v) - h(u, v), h(u, v + 1/h) - h(u, v)).
+    // Empty until computeHeightGradients().
+    std::vector<Eigen::Vector3f> height_gradients;
+
+    // |color| of texel (x, y) of levels[0]
+    float texel_height(int x, int y) const
+    {
+        const auto& color = levels[0].at(x, y);
+        return Eigen::Vector3f(color[0], color[1], color[2]).norm();
+    }
+
+    // Entry (x, y) of height_gradients. Without computeHeightGradients() it is taken from the
+    // image on the spot, to the same value at the cost of three texel reads.
+    Eigen::Vector3f height_gradient(int x, int y) const
+    {
+        if (!height_gradients.empty())
+            return height_gradients[(size_t)y * width + x];
+        // Image rows run towards -v
+        float h = texel_height(x, y);
+        return Eigen::Vector3f(h, texel_height(std::min(x + 1, width - 1), y) - h, texel_height(x, std::max(y - 1, 0)) - h);
+    }
+
+    // Builds levels[1..] with a 2x2 box filter. Odd sizes round down, the last row or column of the
+    // finer level being clamped into the box.
+    void build_mipmaps()
+    {
+        while (levels.back().width > 1 || levels.back().height > 1)
+        {
+            const mip_level& fine = levels.back();
+            mip_level coarse;
+            coarse.resize(std::max(1, fine.width / 2), std::max(1, fine.height / 2));
+            for (int y = 0; y < coarse.height; ++y)
+            {
+                int y0 = std::min(2 * y, fine.height - 1), y1 = std::min(2 * y + 1, fine.height - 1);
+                for (int x = 0; x < coarse.width; ++x)
+                {
+                    int x0 = std::min(2 * x, fine.width - 1), x1 = std::min(2 * x + 1, fine.width - 1);
+                    Eigen::Array4f sum = fine.texel(x0, y0) + fine.texel(x1, y0) + fine.texel(x0, y1) + fine.texel(x1, y1);
+                    auto& t = coarse.at(x, y);
+                    for (int c = 0; c < 4; ++c)
+                        t[c] = (uint8_t)(sum[c] * 0.25f + 0.5f);
+                }
+            }
+            levels.push_back(std::move(coarse));
+        }
+    }
+
+    // Bilinear lookup in one level, RGBA in [0, 255], clamped to the edge
+    Eigen::Array4f bilinear(const mip_level& level, float u, float v) const
+    {
+        float x = u * level.width - 0.5f, y = (1 - v) * level.height - 0.5f;
+        float x_floor = std::floor(x), y_floor = std::floor(y);
+        float fx = x - x_floor, fy = y - y_floor;
+        int x0 = std::clamp((int)x_floor, 0, level.width - 1), x1 = std::min(x0 + 1, level.width - 1);
+        int y0 = std::clamp((int)y_floor, 0, level.height - 1), y1 = std::min(y0 + 1, level.height - 1);
+        if (x_floor < 0)
+            x1 = x0;
+        if (y_floor < 0)
+            y1 = y0;
+        Eigen::Array4f top = level.texel(x0, y0) + fx * (level.texel(x1, y0) - level.texel(x0, y0));
+        Eigen::Array4f bottom = level.texel(x0, y1) + fx * (level.texel(x1, y1) - level.texel(x0, y1));
+        return top + fy * (bottom - top);
+    }
+
+    Eigen::Array4f trilinear(float u, float v, float lod) const
+    {
+        lod = std::clamp(lod, 0.0f, (float)(levels.size() - 1));
+        int l0 = (int)lod, l1 = std::min(l0 + 1, (int)levels.size() - 1);
+        Eigen::Array4f c0 = bilinear(levels[l0], u, v);
+        if (l1 == l0)
+            return c0;
+        return c0 + (lod - l0) * (bilinear(levels[l1], u, v) - c0);
+    }
 
 public:
     Texture(const std::string& name)
     {
-        image_data = cv::imread(name);
+        cv::Mat image_data = cv::imread(name);
         cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
         width = image_data.cols;
         height = image_data.rows;
+
+        levels.emplace_back();
+        levels[0].resize(width, height);
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                auto color = image_data.at<cv::Vec3b>(y, x);
+                levels[0].at(x, y) = {color[0], color[1], color[2], 255};
+            }
+        }
+        build_mipmaps();
     }
 
     int width, height;
 
+    int mipLevels() const { return (int)levels.size(); }
+
+    // Precomputes the height gradients read by getHeightGradient(), spreading the rows over all
+    // hardware threads
+    void computeHeightGradients()
+    {
+        std::vector<float> heights((size_t)width * height);
+        auto for_rows = [&](auto&& row_task) {
+            int num_threads = std::max(1, std::min((int)std::thread::hardware_concurrency(), height));
+            std::vector<std::thread> workers;
+            for (int i = 0; i < num_threads; ++i)
+            {
+                workers.emplace_back([&, i] {
+                    for (int y = height * i / num_threads; y < height * (i + 1) / num_threads; ++y)
+                        row_task(y);
+                });
+            }
+            for (auto& worker : workers)
+                worker.join();
+        };
+
+        for_rows([&](int y) {
+            for (int x = 0; x < width; ++x)
+                heights[(size_t)y * width + x] = texel_height(x, y);
+        });
+        height_gradients.resize(heights.size());
+        for_rows([&](int y) {
+            // Image rows run towards -v
+            int y_next = std::max(y - 1, 0);
+            for (int x = 0; x < width; ++x)
+            {
+                int x_next = std::min(x + 1, width - 1);
+                float h = heights[(size_t)y * width + x];
+                height_gradients[(size_t)y * width + x] = Eigen::Vector3f(h, heights[(size_t)y * width + x_next] - h, heights[(size_t)y_next * width + x] - h);
+            }
+        });
+    }
+
+    // Nearest lookup in the full resolution image, clamped to the edge
     Eigen::Vector3f getColor(float u, float v)
     {
-        auto u_img = u * width;
-        auto v_img = (1 - v) * height;
-        auto color = image_data.at<cv::Vec3b>(v_img, u_img);
+        int u_img = std::clamp((int)(u * width), 0, width - 1);
+        int v_img = std::clamp((int)((1 - v) * height), 0, height - 1);
+        const auto& color = levels[0].at(u_img, v_img);
         return Eigen::Vector3f(color[0], color[1], color[2]);
     }
 
+    // Nearest lookup of (h, dh along +u, dh along +v), see height_gradients. Precomputed by
+    // computeHeightGradients(), otherwise derived from the image at each call.
+    Eigen::Vector3f getHeightGradient(float u, float v)
+    {
+        int u_img = std::clamp((int)(u * width), 0, width - 1);
+        int v_img = std::clamp((int)((1 - v) * height), 0, height - 1);
+        return height_gradient(u_img, v_img);
+    }
+
+    Eigen::Vector3f getColorBilinear(float u, float v)
+    {
+        return bilinear(levels[0], u, v).head<3>().matrix();
+    }
+
+    // Mip level at which one screen pixel covers about one texel, from the uv derivatives along
+    // screen x and y
+    float getLod(float du_dx, float dv_dx, float du_dy, float dv_dy) const
+    {
+        float x_len2 = du_dx * du_dx * width * width + dv_dx * dv_dx * height * height;
+        float y_len2 = du_dy * du_dy * width * width + dv_dy * dv_dy * height * height;
+        return 0.5f * std::log2(std::max({x_len2, y_len2, 1e-20f}));
+    }
+
+    Eigen::Vector3f getColorTrilinear(float u, float v, float lod)
+    {
+        return trilinear(u, v, lod).head<3>().matrix();
+    }
+
+    // Four lookups at once, one per row of the result. Coordinates are clamped to the image since
+    // helper lanes of a quad may lie outside [0, 1].
+    Eigen::Array<float, 4, 3> getColor(const Eigen::Array4f& u, const Eigen::Array4f& v)
+    {
+        Eigen::Array4i u_img = (u * width).cast<int>().max(0).min(width - 1);
+        Eigen::Array4i v_img = ((1 - v) * height).cast<int>().max(0).min(height - 1);
+        Eigen::Array<float, 4, 3> colors;
+        for (int i = 0; i < 4; ++i)
+        {
+            const auto& color = levels[0].at(u_img[i], v_img[i]);
+            colors.row(i) << color[0], color[1], color[2];
+        }
+        return colors;
+    }
+
+    Eigen::Array<float, 4, 3> getHeightGradient(const Eigen::Array4f& u, const Eigen::Array4f& v)
+    {
+        Eigen::Array4i u_img = (u * width).cast<int>().max(0).min(width - 1);
+        Eigen::Array4i v_img = ((1 - v) * height).cast<int>().max(0).min(height - 1);
+        Eigen::Array<float, 4, 3> gradients;
+        for (int i = 0; i < 4; ++i)
+            gradients.row(i) = height_gradient(u_img[i], v_img[i]).transpose().array();
+        return gradients;
+    }
+
+    // Bilinear version of getColor. Its screen-space derivatives are continuous within a texel,
+    // unlike those of the nearest lookup, which are zero inside a texel and spike at its borders.
+    // Each texel is filtered as one RGBA packet.
+    Eigen::Array<float, 4, 3> getColorBilinear(const Eigen::Array4f& u, const Eigen::Array4f& v)
+    {
+        Eigen::Array<float, 4, 3> colors;
+        for (int i = 0; i < 4; ++i)
+            colors.row(i) = bilinear(levels[0], u[i], v[i]).head<3>().transpose();
+        return colors;
+    }
+
+    Eigen::Array4f getLod(const Eigen::Array4f& du_dx, const Eigen::Array4f& dv_dx, const Eigen::Array4f& du_dy, const Eigen::Array4f& dv_dy) const
+    {
+        Eigen::Array4f x_len2 = (du_dx * width).square() + (dv_dx * height).square();
+        Eigen::Array4f y_len2 = (du_dy * width).square() + (dv_dy * height).square();
+        return 0.5f * x_len2.max(y_len2).max(1e-20f).log() / std::log(2.0f);
+    }
+
+    Eigen::Array<float, 4, 3> getColorTrilinear(const Eigen::Array4f& u, const Eigen::Array4f& v, const Eigen::Array4f& lod)
+    {
+        Eigen::Array<float, 4, 3> colors;
+        for (int i = 0; i < 4; ++i)
+            colors.row(i) = trilinear(u[i], v[i], lod[i]).head<3>().transpose();
+        return colors;
+    }
+
 };
 #endif //RASTERIZER_TEXTURE_H
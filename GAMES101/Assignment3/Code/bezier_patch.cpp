@@ -0,0 +1,248 @@
+//
+// Tessellation of bicubic Bezier patches into indexed meshes, refined by screen-space edge length.
+//
+
+#include <algorithm>
+#include <cmath>
+#include "bezier_patch.hpp"
+
+namespace
+{
+    using curve = std::array<Eigen::Vector3f, 4>;
+
+    Eigen::RowVector4f bernstein(float t)
+    {
+        float s = 1 - t;
+        return {s * s * s, 3 * t * s * s, 3 * t * t * s, t * t * t};
+    }
+
+    Eigen::RowVector4f bernstein_derivative(float t)
+    {
+        float s = 1 - t;
+        return {-3 * s * s, 3 * s * s - 6 * t * s, 6 * t * s - 3 * t * t, 3 * t * t};
+    }
+
+    // Control points of a boundary curve of the patch, in the order of growing u or v. Sides are
+    // v = 0, u = 1, v = 1 and u = 0.
+    curve boundary(const rst::bezier_patch& patch, int side)
+    {
+        static constexpr int first[4] = {0, 3, 12, 0};
+        static constexpr int step[4] = {1, 4, 1, 4};
+        return {patch.control[first[side]], patch.control[first[side] + step[side]],
+                patch.control[first[side] + 2 * step[side]], patch.control[first[side] + 3 * step[side]]};
+    }
+
+    // Whether the curve runs backwards from its canonical direction: of the curve and its reverse,
+    // the one whose control points come first lexicographically. A curve equal to its reverse has
+    // both directions alike.
+    bool reversed(const curve& c)
+    {
+        for (int k = 0; k < 4; ++k)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                if (c[3 - k][axis] != c[k][axis])
+                    return c[3 - k][axis] < c[k][axis];
+            }
+        }
+        return false;
+    }
+
+    // Pieces needed to cut the curve's control polygon into pieces of at most edge_pixels on screen
+    int curve_level(const curve& c, const Eigen::Matrix4f& model_to_screen, float edge_pixels)
+    {
+        // Summed in canonical order, so that the patches on both sides get the same count
+        bool backwards = reversed(c);
+        float length = 0;
+        Eigen::Vector4f previous;
+        for (int k = 0; k < 4; ++k)
+        {
+            Eigen::Vector4f screen = model_to_screen * c[backwards ? 3 - k : k].homogeneous();
+            if (k > 0)
+            {
+                if (screen.w() * previous.w() <= 0)
+                    return rst::patch_tessellator::max_level;
+                length += (screen.head<2>() / screen.w() - previous.head<2>() / previous.w()).norm();
+            }
+            previous = screen;
+        }
+        return std::clamp((int)std::ceil(length / edge_pixels), 1, rst::patch_tessellator::max_level);
+    }
+
+    Eigen::Matrix4f coordinate(const rst::bezier_patch& patch, int axis)
+    {
+        Eigen::Matrix4f g;
+        for (int i = 0; i < 4; ++i)
+            for (int j = 0; j < 4; ++j)
+                g(i, j) = patch.control[4 * i + j][axis];
+        return g;
+    }
+
+    // Unit du x dv at (u, v). Where the patch degenerates, e.g. at a pole where a whole boundary
+    // collapses to a point, the normal is taken a little further inside the patch.
+    Eigen::Vector3f patch_normal(const rst::bezier_patch& patch, float u, float v)
+    {
+        for (int attempt = 0; attempt < 4; ++attempt)
+        {
+            Eigen::RowVector4f bu = bernstein(u), bv = bernstein(v);
+            Eigen::RowVector4f dbu = bernstein_derivative(u), dbv = bernstein_derivative(v);
+            Eigen::Vector3f du, dv;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                Eigen::Matrix4f g = coordinate(patch, axis);
+                du[axis] = bv * g * dbu.transpose();
+                dv[axis] = dbv * g * bu.transpose();
+            }
+            Eigen::Vector3f n = du.cross(dv);
+            if (n.squaredNorm() > 1e-20f)
+                return n.normalized();
+            u += (0.5f - u) * 1e-3f * (1 << (3 * attempt));
+            v += (0.5f - v) * 1e-3f * (1 << (3 * attempt));
+        }
+        return Eigen::Vector3f::UnitZ();
+    }
+
+    // Grid vertex i of n along a boundary cut into level pieces, snapped to the nearest cut
+    int snap(int i, int n, int level)
+    {
+        return (2 * i * level + n) / (2 * n);
+    }
+}
+
+rst::patch_tessellator::patch_tessellator(std::vector<bezier_patch> patches)
+    : patch_list(std::move(patches)), tables(max_level + 1)
+{
+    for (int level = 1; level <= max_level; ++level)
+    {
+        basis_table& table = tables[level];
+        table.weights.resize(level + 1, 4);
+        table.derivatives.resize(level + 1, 4);
+        for (int k = 0; k <= level; ++k)
+        {
+            float t = (float)k / level;
+            table.weights.row(k) = bernstein(t);
+            table.derivatives.row(k) = bernstein_derivative(t);
+        }
+    }
+}
+
+void rst::patch_tessellator::tessellate(const Eigen::Matrix4f& model_to_screen, float edge_pixels, indexed_mesh& mesh) const
+{
+    mesh.positions.clear();
+    mesh.normals.clear();
+    mesh.texcoords.clear();
+    mesh.indices.clear();
+    edge_pixels = std::max(edge_pixels, 1e-3f);
+
+    std::vector<int> grid;
+    std::vector<int> cuts[4];
+    for (const bezier_patch& patch : patch_list)
+    {
+        auto add_vertex = [&](const Eigen::Vector3f& position, const Eigen::Vector3f& normal, float u, float v) {
+            mesh.positions.push_back(position);
+            mesh.normals.push_back(normal);
+            mesh.texcoords.emplace_back(u, v);
+            return (int)mesh.positions.size() - 1;
+        };
+
+        // Boundaries: the corners are control points, the cuts in between come from the curve
+        int corners[4];
+        static constexpr int corner_control[4] = {0, 3, 15, 12};
+        static constexpr float corner_uv[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+        for (int c = 0; c < 4; ++c)
+        {
+            float u = corner_uv[c][0], v = corner_uv[c][1];
+            corners[c] = add_vertex(patch.control[corner_control[c]], patch_normal(patch, u, v), u, v);
+        }
+        int levels[4];
+        for (int side = 0; side < 4; ++side)
+        {
+            curve c = boundary(patch, side);
+            int level = levels[side] = curve_level(c, model_to_screen, edge_pixels);
+            bool backwards = reversed(c);
+            if (backwards)
+                std::reverse(c.begin(), c.end());
+            const basis_table& table = tables[level];
+
+            std::vector<int>& cut = cuts[side];
+            cut.assign(level + 1, 0);
+            // Sides run v = 0 and u = 1 from corners 0 and 1, v = 1 and u = 0 from corners 3 and 0
+            static constexpr int start_corner[4] = {0, 1, 3, 0};
+            static constexpr int end_corner[4] = {1, 2, 2, 3};
+            cut[0] = corners[start_corner[side]];
+            cut[level] = corners[end_corner[side]];
+            for (int k = 1; k < level; ++k)
+            {
+                const Eigen::RowVector4f& w = table.weights.row(backwards ? level - k : k);
+                Eigen::Vector3f position = w[0] * c[0] + w[1] * c[1] + w[2] * c[2] + w[3] * c[3];
+                float t = (float)k / level;
+                float u = side == 1 ? 1 : side == 3 ? 0 : t;
+                float v = side == 0 ? 0 : side == 2 ? 1 : t;
+                cut[k] = add_vertex(position, patch_normal(patch, u, v), u, v);
+            }
+        }
+
+        // Inside: as fine as the finer of the opposite boundaries and of the inner control rows
+        int n_u = std::max(levels[0], levels[2]);
+        int n_v = std::max(levels[1], levels[3]);
+        for (int k = 1; k < 3; ++k)
+        {
+            n_u = std::max(n_u, curve_level({patch.control[4 * k], patch.control[4 * k + 1], patch.control[4 * k + 2], patch.control[4 * k + 3]},
+                                            model_to_screen, edge_pixels));
+            n_v = std::max(n_v, curve_level({patch.control[k], patch.control[k + 4], patch.control[k + 8], patch.control[k + 12]},
+                                            model_to_screen, edge_pixels));
+        }
+        const basis_table& table_u = tables[n_u];
+        const basis_table& table_v = tables[n_v];
+
+        // Row j, column i of each product is the point (u_i, v_j)
+        Eigen::MatrixXf position[3], du[3], dv[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            Eigen::Matrix4f g = coordinate(patch, axis);
+            Eigen::Matrix<float, Eigen::Dynamic, 4> vg = table_v.weights * g;
+            position[axis].noalias() = vg * table_u.weights.transpose();
+            du[axis].noalias() = vg * table_u.derivatives.transpose();
+            dv[axis].noalias() = (table_v.derivatives * g) * table_u.weights.transpose();
+        }
+
+        grid.assign((n_u + 1) * (n_v + 1), -1);
+        auto at = [&](int i, int j) -> int& { return grid[j * (n_u + 1) + i]; };
+        for (int i = 0; i <= n_u; ++i)
+        {
+            at(i, 0) = cuts[0][snap(i, n_u, levels[0])];
+            at(i, n_v) = cuts[2][snap(i, n_u, levels[2])];
+        }
+        for (int j = 0; j <= n_v; ++j)
+        {
+            at(0, j) = cuts[3][snap(j, n_v, levels[3])];
+            at(n_u, j) = cuts[1][snap(j, n_v, levels[1])];
+        }
+        for (int j = 1; j < n_v; ++j)
+        {
+            for (int i = 1; i < n_u; ++i)
+            {
+                float u = (float)i / n_u, v = (float)j / n_v;
+                Eigen::Vector3f p(position[0](j, i), position[1](j, i), position[2](j, i));
+                Eigen::Vector3f n = Eigen::Vector3f(du[0](j, i), du[1](j, i), du[2](j, i)).cross(
+                                    Eigen::Vector3f(dv[0](j, i), dv[1](j, i), dv[2](j, i)));
+                n = n.squaredNorm() > 1e-20f ? n.normalized() : patch_normal(patch, u, v);
+                at(i, j) = add_vertex(p, n, u, v);
+            }
+        }
+
+        // Counter-clockwise seen from the side du x dv points to
+        auto add_triangle = [&](int a, int b, int c) {
+            if (a != b && b != c && c != a)
+                mesh.indices.emplace_back(a, b, c);
+        };
+        for (int j = 0; j < n_v; ++j)
+        {
+            for (int i = 0; i < n_u; ++i)
+            {
+                add_triangle(at(i, j), at(i + 1, j), at(i + 1, j + 1));
+                add_triangle(at(i, j), at(i + 1, j + 1), at(i, j + 1));
+            }
+        }
+    }
+}
@@ -0,0 +1,57 @@
+//
+// Tessellation of bicubic Bezier patches into indexed meshes, refined by screen-space edge length.
+//
+
+#pragma once
+
+#include <array>
+#include <eigen3/Eigen/Eigen>
+#include <vector>
+#include "mesh_lod.hpp"
+
+namespace rst
+{
+    // Bicubic Bezier patch. control[4 * i + j] is row i along v and column j along u; the patch
+    // faces the side its normal du x dv points to.
+    struct bezier_patch
+    {
+        std::array<Eigen::Vector3f, 16> control;
+    };
+
+    // Tessellates a fixed set of patches for any transform to the screen. Every boundary curve of a
+    // patch is cut into as many pieces as its control polygon needs to have no piece longer than the
+    // given number of pixels on screen, a count that only depends on the curve's four control
+    // points. The inside of the patch is a regular grid of at least as many pieces as its longer
+    // opposite boundary, whose boundary vertices are snapped onto the points of the boundary curves.
+    // Neighbouring patches that share a boundary curve thus cut it at the same points, evaluated
+    // from the curve alone and in the same direction, so there are neither cracks nor T-junctions
+    // between them. Positions and normals come from tabulated Bernstein bases and their derivatives,
+    // one table per level of subdivision.
+    class patch_tessellator
+    {
+    public:
+        static constexpr int max_level = 64;
+
+        explicit patch_tessellator(std::vector<bezier_patch> patches);
+
+        // Fills mesh, reusing its storage, with the patches tessellated for model_to_screen, the
+        // product of viewport, projection, view and model matrices, to pieces of at most edge_pixels
+        // on screen. Curves reaching behind the eye get max_level pieces. Texcoords are the (u, v) of
+        // each patch. Triangles that boundary snapping makes degenerate are left out.
+        void tessellate(const Eigen::Matrix4f& model_to_screen, float edge_pixels, indexed_mesh& mesh) const;
+
+        const std::vector<bezier_patch>& patches() const { return patch_list; }
+
+    private:
+        // Bernstein weights (rows of 4) of t = k / level for k in [0, level], and their derivatives
+        struct basis_table
+        {
+            Eigen::Matrix<float, Eigen::Dynamic, 4> weights;
+            Eigen::Matrix<float, Eigen::Dynamic, 4> derivatives;
+        };
+
+        std::vector<bezier_patch> patch_list;
+        // tables[level], for level in [1, max_level]
+        std::vector<basis_table> tables;
+    };
+}
@@ -0,0 +1,325 @@
+//
+// Color and depth storage of the rasterizer.
+//
+
+#pragma once
+
+#include <eigen3/Eigen/Eigen>
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace rst
+{
+    // Repeats the first `unit` bytes of dst over its first `size` bytes, doubling the copied range
+    // with each memcpy
+    inline void replicate(uint8_t* dst, size_t unit, size_t size)
+    {
+        for (size_t done = unit; done < size; done *= 2)
+            std::memcpy(dst + done, dst, std::min(done, size - done));
+    }
+
+    enum class ColorFormat
+    {
+        Float,   // Eigen::Vector3f per pixel, RGB in [0, 255]
+        BGR8,    // 8-bit B, G, R, laid out like a CV_8UC3 image
+        BGRA8,   // 8-bit B, G, R, A, laid out like a CV_8UC4 image
+        RGB10A2  // 10-bit R, G, B and 2-bit A packed into a uint32_t, R in the low bits
+    };
+
+    enum class DepthFormat
+    {
+        Float,  // 32-bit float
+        D24,    // 24 bits: the float with its 8 least significant mantissa bits dropped
+        D16     // 16 bits: sign, exponent and the 7 most significant mantissa bits of the float
+    };
+
+    // Framebuffer colors, set and read as RGB in [0, 255]. The 8- and 10-bit formats round and clamp
+    // when a pixel is set, so the image handed to OpenCV needs no further pass.
+    class color_buffer
+    {
+    public:
+        color_buffer(int w, int h, ColorFormat format = ColorFormat::BGR8)
+            : width(w), height(h), pixel_format(format)
+        {
+            data.resize((size_t)w * h * bytes_per_pixel());
+        }
+
+        ColorFormat format() const { return pixel_format; }
+        int size() const { return width * height; }
+
+        void set(int index, const Eigen::Vector3f& color)
+        {
+            uint8_t* p = &data[(size_t)index * bytes_per_pixel()];
+            switch (pixel_format)
+            {
+                case ColorFormat::Float:
+                    std::memcpy(p, color.data(), sizeof(Eigen::Vector3f));
+                    break;
+                case ColorFormat::BGRA8:
+                    p[3] = 255;
+                    [[fallthrough]];
+                case ColorFormat::BGR8:
+                    p[0] = unorm8(color[2]);
+                    p[1] = unorm8(color[1]);
+                    p[2] = unorm8(color[0]);
+                    break;
+                case ColorFormat::RGB10A2:
+                {
+                    uint32_t packed = unorm10(color[0]) | unorm10(color[1]) << 10 | unorm10(color[2]) << 20 | 3u << 30;
+                    std::memcpy(p, &packed, sizeof(packed));
+                    break;
+                }
+            }
+        }
+
+        Eigen::Vector3f get(int index) const
+        {
+            const uint8_t* p = &data[(size_t)index * bytes_per_pixel()];
+            switch (pixel_format)
+            {
+                case ColorFormat::Float:
+                {
+                    Eigen::Vector3f color;
+                    std::memcpy(color.data(), p, sizeof(Eigen::Vector3f));
+                    return color;
+                }
+                case ColorFormat::BGR8:
+                case ColorFormat::BGRA8:
+                    return Eigen::Vector3f(p[2], p[1], p[0]);
+                default:
+                {
+                    uint32_t packed;
+                    std::memcpy(&packed, p, sizeof(packed));
+                    return Eigen::Vector3f(packed & 1023, packed >> 10 & 1023, packed >> 20 & 1023) * (255.0f / 1023);
+                }
+            }
+        }
+
+        void fill(const Eigen::Vector3f& color)
+        {
+            if (data.empty())
+                return;
+            set(0, color);
+            replicate(data.data(), bytes_per_pixel(), data.size());
+        }
+
+        // The image for OpenCV, as 8-bit BGR or, for BGRA8, BGRA. BGR8 and BGRA8 buffers are wrapped
+        // as they are, without a copy, so the Mat is only valid as long as the buffer; the other
+        // formats are converted into a new Mat.
+        cv::Mat image()
+        {
+            if (pixel_format == ColorFormat::BGR8)
+                return cv::Mat(height, width, CV_8UC3, data.data());
+            if (pixel_format == ColorFormat::BGRA8)
+                return cv::Mat(height, width, CV_8UC4, data.data());
+
+            cv::Mat bgr(height, width, CV_8UC3);
+            for (int i = 0; i < size(); ++i)
+            {
+                Eigen::Vector3f color = get(i);
+                uint8_t* p = bgr.data + (size_t)i * 3;
+                p[0] = unorm8(color[2]);
+                p[1] = unorm8(color[1]);
+                p[2] = unorm8(color[0]);
+            }
+            return bgr;
+        }
+
+    private:
+        size_t bytes_per_pixel() const
+        {
+            switch (pixel_format)
+            {
+                case ColorFormat::Float: return sizeof(Eigen::Vector3f);
+                case ColorFormat::BGR8: return 3;
+                default: return 4;
+            }
+        }
+
+        // Rounds c in [0, 2^22] to the nearest integer, even on ties: adding 1.5 * 2^23 leaves no
+        // fraction bits, so the FPU does the rounding. Unlike std::lrint this is never a library call.
+        static float round_even(float c)
+        {
+            return (c + 12582912.0f) - 12582912.0f;
+        }
+
+        // Round and saturate, like OpenCV's convertTo; NaN maps to 0
+        static uint8_t unorm8(float c)
+        {
+            return (uint8_t)round_even(c >= 0 ? std::min(c, 255.0f) : 0.0f);
+        }
+
+        static uint32_t unorm10(float c)
+        {
+            return (uint32_t)round_even(c >= 0 ? std::min(c, 255.0f) * (1023.0f / 255) : 0.0f);
+        }
+
+        int width, height;
+        ColorFormat pixel_format;
+        std::vector<uint8_t> data;
+    };
+
+    // Depth samples. The reduced formats keep the leading bits of the float, remapped to an unsigned
+    // key that orders like the float itself, so they need no depth range, compare as integers and
+    // decode to a value no farther than the one stored. Depth tests are done on the keys.
+    class depth_buffer
+    {
+    public:
+        explicit depth_buffer(DepthFormat format = DepthFormat::Float) : depth_format(format) {}
+
+        DepthFormat format() const { return depth_format; }
+        size_t size() const { return count; }
+
+        // Resizes to n samples, all at infinity
+        void reset(size_t n, DepthFormat format)
+        {
+            depth_format = format;
+            count = n;
+            f32.clear();
+            d16.clear();
+            d24.clear();
+            switch (format)
+            {
+                case DepthFormat::Float: f32.resize(n); break;
+                case DepthFormat::D24: d24.resize(n * 3); break;
+                case DepthFormat::D16: d16.resize(n); break;
+            }
+            fill(0, n, std::numeric_limits<float>::infinity());
+        }
+
+        void fill(size_t first, size_t n, float z)
+        {
+            switch (depth_format)
+            {
+                case DepthFormat::Float:
+                    std::fill_n(&f32[first], n, z);
+                    break;
+                case DepthFormat::D24:
+                    if (n == 0)
+                        return;
+                    set(first, z);
+                    replicate(&d24[first * 3], 3, n * 3);
+                    break;
+                case DepthFormat::D16:
+                    std::fill_n(&d16[first], n, (uint16_t)key(z));
+                    break;
+            }
+        }
+
+        // True if z is nearer than sample i at the precision of the buffer
+        bool nearer(size_t i, float z) const
+        {
+            if (depth_format == DepthFormat::Float)
+                return z < f32[i];
+            return key(z) < load_key(i);
+        }
+
+        void set(size_t i, float z)
+        {
+            switch (depth_format)
+            {
+                case DepthFormat::Float:
+                    f32[i] = z;
+                    break;
+                case DepthFormat::D24:
+                {
+                    uint32_t k = key(z);
+                    d24[i * 3] = (uint8_t)k;
+                    d24[i * 3 + 1] = (uint8_t)(k >> 8);
+                    d24[i * 3 + 2] = (uint8_t)(k >> 16);
+                    break;
+                }
+                case DepthFormat::D16:
+                    d16[i] = (uint16_t)key(z);
+                    break;
+            }
+        }
+
+        // Depth test of samples [first, first + n) against z[0, n), for the samples in mask only.
+        // Writes and returns the mask of the samples that passed.
+        int test_and_set(size_t first, int n, const float* z, int mask)
+        {
+            int passed = 0;
+            if (depth_format == DepthFormat::Float)
+            {
+                float* depth = &f32[first];
+                for (int s = 0; s < n; ++s)
+                {
+                    if ((mask >> s & 1) && z[s] < depth[s])
+                    {
+                        depth[s] = z[s];
+                        passed |= 1 << s;
+                    }
+                }
+                return passed;
+            }
+            for (int s = 0; s < n; ++s)
+            {
+                if ((mask >> s & 1) && nearer(first + s, z[s]))
+                {
+                    set(first + s, z[s]);
+                    passed |= 1 << s;
+                }
+            }
+            return passed;
+        }
+
+        float get(size_t i) const
+        {
+            if (depth_format == DepthFormat::Float)
+                return f32[i];
+            return from_key(load_key(i));
+        }
+
+        // Farthest of samples [first, first + n)
+        float max(size_t first, size_t n) const
+        {
+            if (depth_format == DepthFormat::Float)
+                return *std::max_element(&f32[first], &f32[first] + n);
+            uint32_t k = 0;
+            for (size_t i = first; i < first + n; ++i)
+                k = std::max(k, load_key(i));
+            return from_key(k);
+        }
+
+    private:
+        int key_bits() const { return depth_format == DepthFormat::D24 ? 24 : 16; }
+
+        uint32_t load_key(size_t i) const
+        {
+            if (depth_format == DepthFormat::D16)
+                return d16[i];
+            return d24[i * 3] | (uint32_t)d24[i * 3 + 1] << 8 | (uint32_t)d24[i * 3 + 2] << 16;
+        }
+
+        // Flipping all bits of negative floats and the sign bit of the others makes their bit
+        // patterns order like the floats
+        uint32_t key(float z) const
+        {
+            uint32_t bits;
+            std::memcpy(&bits, &z, 4);
+            bits = bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+            return bits >> (32 - key_bits());
+        }
+
+        float from_key(uint32_t k) const
+        {
+            uint32_t bits = k << (32 - key_bits());
+            bits = bits & 0x80000000u ? bits & 0x7fffffffu : ~bits;
+            float z;
+            std::memcpy(&z, &bits, 4);
+            return z;
+        }
+
+        DepthFormat depth_format;
+        size_t count = 0;
+        // Storage of the current format only: floats, 16-bit keys, or 24-bit keys as 3 bytes each
+        std::vector<float> f32;
+        std::vector<uint16_t> d16;
+        std::vector<uint8_t> d24;
+    };
+}
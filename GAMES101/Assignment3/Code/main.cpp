@@ -1,4 +1,14 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
 #include <opencv2/opencv.hpp>
 
 #include "global.hpp"
@@ -81,6 +91,57 @@ Eigen::Matrix4f get_projection_matrix(float eye_fov, float aspect_ratio, float z
 
 }
 
+// View matrix of a camera at eye looking at target, with up roughly along up
+Eigen::Matrix4f get_look_at_matrix(const Eigen::Vector3f& eye, const Eigen::Vector3f& target, const Eigen::Vector3f& up)
+{
+    // The camera looks down -z
+    Eigen::Vector3f z = (eye - target).normalized();
+    Eigen::Vector3f x = up.cross(z);
+    if (x.norm() < 1e-6f)
+        x = Eigen::Vector3f(1, 0, 0).cross(z);
+    x.normalize();
+    Eigen::Vector3f y = z.cross(x);
+
+    Eigen::Matrix4f view = Eigen::Matrix4f::Identity();
+    view.row(0).head<3>() = x.transpose();
+    view.row(1).head<3>() = y.transpose();
+    view.row(2).head<3>() = z.transpose();
+    view.col(3).head<3>() = -view.topLeftCorner<3, 3>() * eye;
+    return view;
+}
+
+// The OBJ loader emits one vertex per face corner. Corners with identical attributes are welded
+// into one vertex so that shared vertices go through the vertex stage only once.
+rst::indexed_mesh weld_vertices(const std::vector<objl::Mesh>& meshes)
+{
+    rst::indexed_mesh out;
+    std::map<std::array<float, 8>, int> lookup;
+    for (const auto& mesh : meshes)
+    {
+        for (size_t i = 0; i + 2 < mesh.Vertices.size(); i += 3)
+        {
+            Eigen::Vector3i tri;
+            for (int j = 0; j < 3; j++)
+            {
+                const auto& v = mesh.Vertices[i + j];
+                std::array<float, 8> key = {v.Position.X, v.Position.Y, v.Position.Z,
+                                            v.Normal.X, v.Normal.Y, v.Normal.Z,
+                                            v.TextureCoordinate.X, v.TextureCoordinate.Y};
+                auto it = lookup.emplace(key, (int)out.positions.size());
+                if (it.second)
+                {
+                    out.positions.emplace_back(v.Position.X, v.Position.Y, v.Position.Z);
+                    out.normals.emplace_back(v.Normal.X, v.Normal.Y, v.Normal.Z);
+                    out.texcoords.emplace_back(v.TextureCoordinate.X, v.TextureCoordinate.Y);
+                }
+                tri[j] = it.first->second;
+            }
+            out.indices.push_back(tri);
+        }
+    }
+    return out;
+}
+
 Eigen::Vector3f vertex_shader(const vertex_shader_payload& payload)
 {
     return payload.position;
@@ -94,17 +155,100 @@ Eigen::Vector3f normal_fragment_shader(const fragment_shader_payload& payload)
     return result;
 }
 
+// Writes images on a pool of threads, so that rendering the next frame overlaps with encoding the
+// previous ones. push() blocks while max_pending images are waiting to be written.
+class frame_writer
+{
+public:
+    frame_writer(int num_threads, int max_pending) : max_pending(std::max(1, max_pending))
+    {
+        for (int i = 0; i < std::max(1, num_threads); ++i)
+            threads.emplace_back([this] { run(); });
+    }
+
+    ~frame_writer() { finish(); }
+
+    // The image must not share its data with anything the caller will modify
+    void push(std::string filename, cv::Mat image)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return (int)pending.size() < max_pending; });
+        pending.emplace_back(std::move(filename), std::move(image));
+        not_empty.notify_one();
+    }
+
+    // Waits until every pushed image is written and stops the threads
+    void finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        not_empty.notify_all();
+        for (auto& th : threads)
+            th.join();
+        threads.clear();
+    }
+
+    // Number of images cv::imwrite failed to write
+    int failed() const { return failures; }
+
+private:
+    void run()
+    {
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this] { return done || !pending.empty(); });
+            if (pending.empty())
+                return;
+            auto frame = std::move(pending.front());
+            pending.pop_front();
+            not_full.notify_one();
+            lock.unlock();
+
+            if (!cv::imwrite(frame.first, frame.second))
+            {
+                lock.lock();
+                ++failures;
+            }
+        }
+    }
+
+    int max_pending;
+    int failures = 0;
+    bool done = false;
+    std::deque<std::pair<std::string, cv::Mat>> pending;
+    std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+    std::vector<std::thread> threads;
+};
+
 static Eigen::Vector3f reflect(const Eigen::Vector3f& vec, const Eigen::Vector3f& axis)
 {
     auto costheta = vec.dot(axis);
     return (2 * costheta * axis - vec).normalized();
 }
 
-struct light
+// Lights of the scene, read directly by the scalar Blinn-Phong shaders. The quad shaders take theirs
+// from the payload, main() handing these to the rasterizer together with the shadow map of each.
+static const std::vector<light> scene_lights = {{{20, 20, 20}, {500, 500, 500}}, {{-20, 20, 0}, {500, 500, 500}}};
+
+// Blinn-Phong material and viewer shared by the scalar and quad shaders. kd is the shader's own.
+static const Eigen::Vector3f scene_ka{0.005, 0.005, 0.005};
+static const Eigen::Vector3f scene_ks{0.7937, 0.7937, 0.7937};
+static const float scene_p = 150;
+// Ambient intensity that comes with each light
+static const Eigen::Vector3f scene_amb_light_intensity{10, 10, 10};
+static const Eigen::Vector3f scene_eye_pos{0, 0, 10};
+
+// Fraction of light i reaching a view-space point, 1 if the payload has no shadow maps
+static float light_visibility(const fragment_shader_payload& payload, size_t i, const Eigen::Vector3f& point, const Eigen::Vector3f& normal)
 {
-    Eigen::Vector3f position;
-    Eigen::Vector3f intensity;
-};
+    if (!payload.shadow_maps || i >= payload.shadow_maps->size())
+        return 1.0f;
+    return (*payload.shadow_maps)[i].getVisibility(point, normal);
+}
 
 Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 {
@@ -117,18 +261,15 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
     Eigen::Vector3f texture_color;
     texture_color << return_color.x(), return_color.y(), return_color.z();
 
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    Eigen::Vector3f ka = scene_ka;
     Eigen::Vector3f kd = texture_color / 255.f;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
+    Eigen::Vector3f ks = scene_ks;
 
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
+    const std::vector<light>& lights = scene_lights;
+    Eigen::Vector3f amb_light_intensity = scene_amb_light_intensity;
+    Eigen::Vector3f eye_pos = scene_eye_pos;
 
-    float p = 150;
+    float p = scene_p;
 
     Eigen::Vector3f color = texture_color;
     Eigen::Vector3f point = payload.view_pos;
@@ -136,8 +277,9 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 
     Eigen::Vector3f result_color = {0, 0, 0};
 
-    for (auto& light : lights)
+    for (size_t i = 0; i < lights.size(); ++i)
     {
+        auto& light = lights[i];
         // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
         // components are. Then, accumulate that result on the *result_color* object.
         
@@ -164,8 +306,11 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
         float cos_alpha = std::max(0.0f, normal.dot(half_dir));
         Eigen::Vector3f specular = ks.cwiseProduct(light.intensity) * std::pow(cos_alpha, p) / r_squared;
         
+        // 阴影图遮住的部分只剩环境光
+        float visibility = light_visibility(payload, i, point, normal);
+
         // 累加到结果颜色
-        result_color += ambient + diffuse + specular;
+        result_color += ambient + visibility * (diffuse + specular);
     }
 
     return result_color * 255.f;
@@ -173,26 +318,24 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 
 Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
 {
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    Eigen::Vector3f ka = scene_ka;
     Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
+    Eigen::Vector3f ks = scene_ks;
 
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
+    const std::vector<light>& lights = scene_lights;
+    Eigen::Vector3f amb_light_intensity = scene_amb_light_intensity;
+    Eigen::Vector3f eye_pos = scene_eye_pos;
 
-    float p = 150;
+    float p = scene_p;
 
     Eigen::Vector3f color = payload.color;
     Eigen::Vector3f point = payload.view_pos;
     Eigen::Vector3f normal = payload.normal;
 
     Eigen::Vector3f result_color = {0, 0, 0};
-    for (auto& light : lights)
+    for (size_t i = 0; i < lights.size(); ++i)
     {
+        auto& light = lights[i];
         // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
         // components are. Then, accumulate that result on the *result_color* object.
         
@@ -219,8 +362,11 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
         float cos_alpha = std::max(0.0f, normal.dot(half_dir));
         Eigen::Vector3f specular = ks.cwiseProduct(light.intensity) * std::pow(cos_alpha, p) / r_squared;
         
+        // 阴影图遮住的部分只剩环境光
+        float visibility = light_visibility(payload, i, point, normal);
+
         // 累加到结果颜色
-        result_color += ambient + diffuse + specular;
+        result_color += ambient + visibility * (diffuse + specular);
     }
 
     return result_color * 255.f;
@@ -231,18 +377,15 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
 Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payload)
 {
     
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    Eigen::Vector3f ka = scene_ka;
     Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
+    Eigen::Vector3f ks = scene_ks;
 
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
+    const std::vector<light>& lights = scene_lights;
+    Eigen::Vector3f amb_light_intensity = scene_amb_light_intensity;
+    Eigen::Vector3f eye_pos = scene_eye_pos;
 
-    float p = 150;
+    float p = scene_p;
 
     Eigen::Vector3f color = payload.color; 
     Eigen::Vector3f point = payload.view_pos;
@@ -283,15 +426,15 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
     // 计算高度图的梯度
     float u = payload.tex_coords.x();
     float v = payload.tex_coords.y();
-    float w = payload.texture->width;
-    float h = payload.texture->height;
-    
+    // 高度值及其梯度, 由 computeHeightGradients() 预先算好, 只取一次
+    Eigen::Vector3f height_gradient = payload.texture->getHeightGradient(u, v);
+
     // 计算当前点的高度值
-    float h_uv = payload.texture->getColor(u, v).norm();
+    float h_uv = height_gradient.x();
     
     // 计算 dU 和 dV
-    float dU = kh * kn * (payload.texture->getColor(u + 1.0f/w, v).norm() - h_uv);
-    float dV = kh * kn * (payload.texture->getColor(u, v + 1.0f/h).norm() - h_uv);
+    float dU = kh * kn * height_gradient.y();
+    float dV = kh * kn * height_gradient.z();
     
     // 修改顶点位置 (displacement mapping 的关键)
     point = point + kn * normal * h_uv;
@@ -303,8 +446,9 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
 
     Eigen::Vector3f result_color = {0, 0, 0};
 
-    for (auto& light : lights)
+    for (size_t i = 0; i < lights.size(); ++i)
     {
+        auto& light = lights[i];
         // 计算光照方向向量
         Eigen::Vector3f light_dir = (light.position - point).normalized();
         
@@ -328,8 +472,11 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
         float cos_alpha = std::max(0.0f, normal.dot(half_dir));
         Eigen::Vector3f specular = ks.cwiseProduct(light.intensity) * std::pow(cos_alpha, p) / r_squared;
         
+        // 阴影图遮住的部分只剩环境光
+        float visibility = light_visibility(payload, i, point, normal);
+
         // 累加到结果颜色
-        result_color += ambient + diffuse + specular;
+        result_color += ambient + visibility * (diffuse + specular);
     }
 
     return result_color * 255.f;
@@ -339,18 +486,15 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
 Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
 {
     
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    Eigen::Vector3f ka = scene_ka;
     Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
+    Eigen::Vector3f ks = scene_ks;
 
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
+    const std::vector<light>& lights = scene_lights;
+    Eigen::Vector3f amb_light_intensity = scene_amb_light_intensity;
+    Eigen::Vector3f eye_pos = scene_eye_pos;
 
-    float p = 150;
+    float p = scene_p;
 
     Eigen::Vector3f color = payload.color; 
     Eigen::Vector3f point = payload.view_pos;
@@ -391,12 +535,10 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     // 计算高度图的梯度
     float u = payload.tex_coords.x();
     float v = payload.tex_coords.y();
-    float w = payload.texture->width;
-    float h = payload.texture->height;
-    
-    // 计算 dU 和 dV
-    float dU = kh * kn * (payload.texture->getColor(u + 1.0f/w, v).norm() - payload.texture->getColor(u, v).norm());
-    float dV = kh * kn * (payload.texture->getColor(u, v + 1.0f/h).norm() - payload.texture->getColor(u, v).norm());
+    // 计算 dU 和 dV, 梯度由 computeHeightGradients() 预先算好, 只取一次
+    Eigen::Vector3f height_gradient = payload.texture->getHeightGradient(u, v);
+    float dU = kh * kn * height_gradient.y();
+    float dV = kh * kn * height_gradient.z();
     
     // 计算新的法向量
     Eigen::Vector3f ln(-dU, -dV, 1.0f);
@@ -404,8 +546,9 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
 
 
     Eigen::Vector3f result_color = {0, 0, 0};
-    for (auto& light : lights)
+    for (size_t i = 0; i < lights.size(); ++i)
     {
+        auto& light = lights[i];
         // 计算光照方向向量
         Eigen::Vector3f light_dir = (light.position - point).normalized();
         
@@ -429,104 +572,644 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
         float cos_alpha = std::max(0.0f, normal.dot(half_dir));
         Eigen::Vector3f specular = ks.cwiseProduct(light.intensity) * std::pow(cos_alpha, p) / r_squared;
         
+        // 阴影图遮住的部分只剩环境光
+        float visibility = light_visibility(payload, i, point, normal);
+
         // 累加到结果颜色
-        result_color += ambient + diffuse + specular;
+        result_color += ambient + visibility * (diffuse + specular);
     }
 
     return result_color * 255.f;
 }
 
-int main(int argc, const char** argv)
+// Quad versions of the shaders above: the same Blinn-Phong model evaluated on the four lanes of a
+// 2x2 quad at once, one Eigen packet per attribute component.
+
+// x^n by repeated squaring. Lanes below cutoff are flushed to zero first: their power would be
+// negligible anyway, and its denormal intermediates are very slow to multiply.
+static quad1f pow_quad(const quad1f& x, int n, float cutoff)
 {
-    std::vector<Triangle*> TriangleList;
+    quad1f base = (x > cutoff).select(x, 0.0f);
+    quad1f result = quad1f::Ones();
+    for (; n > 0; n >>= 1, base *= base)
+        if (n & 1)
+            result *= base;
+    return result;
+}
 
-    float angle = 140.0;
-    bool command_line = false;
+// Lights come from the payload; with a tile list only the lights in it are evaluated.
+static quad3f blinn_phong_quad(const quad3f& kd, const quad3f& point, const quad3f& normal, const fragment_quad_payload& payload)
+{
+    const Eigen::Array3f ka = scene_ka.array();
+    // Added once, as much as the scalar shaders add over the scene lights
+    const Eigen::Array3f amb_light_intensity = scene_amb_light_intensity.array() * (float)scene_lights.size();
+    const Eigen::Array3f eye_pos = scene_eye_pos.array();
+    // ks is gray
+    const float ks = scene_ks.x();
+    const int p = (int)scene_p;
+    // cutoff^p is about 1e-30
+    static const float cutoff = std::pow(1e-30f, 1.0f / p);
+
+    quad3f view_dir = (-point).rowwise() + eye_pos.transpose();
+    view_dir.colwise() *= view_dir.square().rowwise().sum().rsqrt();
+
+    quad3f result_color = quad3f::Zero();
+    result_color.rowwise() += (ka * amb_light_intensity).transpose();
+    if (!payload.lights)
+        return result_color * 255.f;
+
+    const std::vector<ShadowMap>* shadow_maps = payload.shadow_maps;
+    auto add_light = [&](size_t i) {
+        const light& light = (*payload.lights)[i];
+        quad3f light_dir = (-point).rowwise() + light.position.array().transpose();
+        quad1f r_squared = light_dir.square().rowwise().sum();
+        Eigen::Array<bool, 4, 1> in_range = r_squared <= light.radius * light.radius;
+        if (!in_range.any())
+            return;
+        light_dir.colwise() *= r_squared.rsqrt();
+
+        quad3f half_dir = light_dir + view_dir;
+        half_dir.colwise() *= half_dir.square().rowwise().sum().rsqrt();
+
+        quad1f cos_theta = in_range.select((normal * light_dir).rowwise().sum().max(0.0f), 0.0f);
+        quad1f cos_alpha = (normal * half_dir).rowwise().sum().max(0.0f);
+        quad1f specular = in_range.select(ks * pow_quad(cos_alpha, p, cutoff), 0.0f);
+        if (shadow_maps && i < shadow_maps->size())
+        {
+            quad1f visibility = (*shadow_maps)[i].getVisibility(point, normal, cos_theta > 0 || specular > 0);
+            cos_theta *= visibility;
+            specular *= visibility;
+        }
 
-    std::string filename = "output.png";
-    objl::Loader Loader;
-    std::string obj_path = "../models/spot/";
+        Eigen::Array3f intensity = light.intensity.array();
+        result_color += (kd.rowwise() * intensity.transpose()).colwise() * (cos_theta / r_squared);
+        result_color += (specular / r_squared).replicate<1, 3>().rowwise() * intensity.transpose();
+    };
+    if (payload.tile_lights)
+    {
+        for (int i : *payload.tile_lights)
+            add_light(i);
+    }
+    else
+    {
+        for (size_t i = 0; i < payload.lights->size(); ++i)
+            add_light(i);
+    }
 
-    // Load .obj File
-    bool loadout = Loader.LoadFile("../models/spot/spot_triangulated_good.obj");
-    for(auto mesh:Loader.LoadedMeshes)
+    return result_color * 255.f;
+}
+
+// Normal perturbed by the height map kh * kn * |h(u, v)|, as in bump_fragment_shader, from the
+// precomputed height gradient (h, dh along +u, dh along +v)
+static quad3f perturb_normal(const fragment_quad_payload& payload, const quad3f& height_gradient)
+{
+    float kh = 0.2, kn = 0.1;
+    const quad3f& n = payload.normal;
+    quad1f x = n.col(0), y = n.col(1), z = n.col(2);
+
+    quad1f sqrt_xz = (x * x + z * z).sqrt();
+    quad3f t;
+    t << x * y / sqrt_xz, sqrt_xz, z * y / sqrt_xz;
+    t.colwise() *= t.square().rowwise().sum().rsqrt();
+    quad3f b;
+    b << y * t.col(2) - z * t.col(1), z * t.col(0) - x * t.col(2), x * t.col(1) - y * t.col(0);
+
+    quad1f dU = kh * kn * height_gradient.col(1);
+    quad1f dV = kh * kn * height_gradient.col(2);
+
+    quad3f normal = (t.colwise() * -dU) + (b.colwise() * -dV) + n;
+    normal.colwise() *= normal.square().rowwise().sum().rsqrt();
+    return normal;
+}
+
+quad3f phong_quad_shader(const fragment_quad_payload& payload)
+{
+    return blinn_phong_quad(payload.color, payload.view_pos, payload.normal, payload);
+}
+
+quad3f texture_quad_shader(const fragment_quad_payload& payload)
+{
+    quad3f texture_color = quad3f::Zero();
+    if (payload.texture)
+    {
+        // Trilinear lookup, the mip level chosen from the uv footprint of the pixel
+        quad1f u = payload.tex_coords.col(0), v = payload.tex_coords.col(1);
+        quad1f lod = payload.texture->getLod(quad_ddx(u), quad_ddx(v), quad_ddy(u), quad_ddy(v));
+        texture_color = payload.texture->getColorTrilinear(u, v, lod);
+    }
+    return blinn_phong_quad(texture_color / 255.f, payload.view_pos, payload.normal, payload);
+}
+
+quad3f bump_quad_shader(const fragment_quad_payload& payload)
+{
+    quad3f height_gradient = payload.texture->getHeightGradient(payload.tex_coords.col(0), payload.tex_coords.col(1));
+    return blinn_phong_quad(payload.color, payload.view_pos, perturb_normal(payload, height_gradient), payload);
+}
+
+quad3f displacement_quad_shader(const fragment_quad_payload& payload)
+{
+    float kn = 0.1;
+    quad3f height_gradient = payload.texture->getHeightGradient(payload.tex_coords.col(0), payload.tex_coords.col(1));
+    quad3f point = payload.view_pos + (payload.normal * kn).colwise() * height_gradient.col(0);
+    return blinn_phong_quad(payload.color, point, perturb_normal(payload, height_gradient), payload);
+}
+
+// Draws with the scalar shader F inlined into the pixel loop, where set_fragment_shader() would call
+// it through std::function
+template <auto F>
+void draw_inlined(rst::rasterizer& r, rst::pos_buf_id pos_id, rst::ind_buf_id ind_id, rst::col_buf_id col_id)
+{
+    r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, rst::static_shader<F>{});
+}
+
+// Shaders selectable by name. Textured ones read spot_texture.png, the others the height map.
+struct named_shader
+{
+    const char* name;
+    Eigen::Vector3f (*scalar)(const fragment_shader_payload&);
+    // Drawn through this instead when not null
+    quad3f (*quad)(const fragment_quad_payload&);
+    bool textured;
+    // Whether the shader samples the shadow maps of its payload; the depth passes are skipped if not
+    bool shadowed;
+    // The scalar shader drawn by draw_inlined(), for run_benchmark() to compare with std::function
+    void (*inlined)(rst::rasterizer&, rst::pos_buf_id, rst::ind_buf_id, rst::col_buf_id);
+};
+
+static const named_shader named_shaders[] = {
+    {"normal", normal_fragment_shader, nullptr, false, false, nullptr},
+    {"phong", phong_fragment_shader, phong_quad_shader, false, true, draw_inlined<phong_fragment_shader>},
+    {"texture", texture_fragment_shader, texture_quad_shader, true, true, nullptr},
+    {"bump", bump_fragment_shader, bump_quad_shader, false, true, draw_inlined<bump_fragment_shader>},
+    {"displacement", displacement_fragment_shader, displacement_quad_shader, false, true, draw_inlined<displacement_fragment_shader>},
+};
+
+// Depth pass from each of scene_lights, drawn with shadow_pass, into shadow maps looked up with the
+// view-space positions of a camera with view matrix view. Each light gets a perspective frustum
+// fitted around the bounding sphere of the mesh.
+std::vector<ShadowMap> render_shadow_maps(rst::rasterizer& shadow_pass, rst::pos_buf_id pos_id, rst::ind_buf_id ind_id,
+                                          const Eigen::Matrix4f& model, const Eigen::Matrix4f& view)
+{
+    Eigen::Matrix4f mv = view * model;
+    const Eigen::Vector4f& sphere = shadow_pass.bounding_sphere(pos_id);
+    Eigen::Vector3f center = (mv * sphere.head<3>().homogeneous()).head<3>();
+    float radius = sphere.w() * mv.topLeftCorner<3, 3>().colwise().norm().maxCoeff();
+
+    std::vector<ShadowMap> maps;
+    for (const auto& light : scene_lights)
     {
-        for(int i=0;i<mesh.Vertices.size();i+=3)
+        float distance = (light.position - center).norm();
+        float half_angle = std::asin(std::min(1.0f, radius / distance));
+        float fov = std::min(2 * half_angle * 180.0f / (float)MY_PI, 170.0f);
+        float z_near = std::max(distance - radius, 0.01f * distance);
+        float z_far = distance + radius;
+
+        shadow_pass.clear(rst::Buffers::Depth);
+        shadow_pass.set_model(model);
+        shadow_pass.set_view(get_look_at_matrix(light.position, center, {0, 1, 0}) * view);
+        shadow_pass.set_projection(get_projection_matrix(fov, 1, z_near, z_far));
+        shadow_pass.set_near_plane(z_near);
+        shadow_pass.draw_depth(pos_id, ind_id);
+
+        maps.push_back(shadow_pass.shadow_map(view.inverse()));
+    }
+    return maps;
+}
+
+// count dim point lights of random colors, each a little above a random vertex of the mesh placed
+// by mv. Their radius is where they fall below one 8-bit color level, so that tiled light culling
+// leaves each to the few screen tiles around it.
+std::vector<light> scatter_lights(const rst::indexed_mesh& mesh, const Eigen::Matrix4f& mv, int count)
+{
+    std::mt19937 rng(101);
+    std::uniform_int_distribution<int> vertex(0, (int)mesh.positions.size() - 1);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    Eigen::Matrix3f normal_matrix = mv.topLeftCorner<3, 3>().inverse().transpose();
+
+    std::vector<light> lights;
+    for (int i = 0; i < count && !mesh.positions.empty(); ++i)
+    {
+        int v = vertex(rng);
+        Eigen::Vector3f position = (mv * mesh.positions[v].homogeneous()).head<3>();
+        Eigen::Vector3f normal = (normal_matrix * mesh.normals[v]).normalized();
+
+        light l;
+        l.position = position + (0.2f + 0.3f * unit(rng)) * normal;
+        l.intensity = Eigen::Vector3f(unit(rng), unit(rng), unit(rng)) * 0.01f;
+        l.radius = attenuation_radius(l.intensity, 1.0f / 255);
+        lights.push_back(l);
+    }
+    return lights;
+}
+
+// The cow placed by model and crowd more behind it, in rows of five, each row 3 units farther
+// back. They are listed back to front, leaving the ordering to draw_objects().
+std::vector<rst::draw_object> crowd_objects(rst::pos_buf_id pos_id, rst::ind_buf_id ind_id, rst::col_buf_id col_id,
+                                            const Eigen::Matrix4f& model, int crowd)
+{
+    std::vector<rst::draw_object> objects;
+    for (int i = crowd; i >= 0; --i)
+    {
+        rst::draw_object object;
+        object.pos = pos_id;
+        object.ind = ind_id;
+        object.col = col_id;
+        object.model = model;
+        if (i > 0)
+            object.model.col(3).head<3>() += Eigen::Vector3f(((i - 1) % 5 - 2) * 2.5f, 0, -3.0f * ((i - 1) / 5 + 1));
+        objects.push_back(object);
+    }
+    return objects;
+}
+
+// A torus of 16 bicubic patches around the z axis, with tube radius minor and the center of the
+// tube at radius major. Both of its circles are made of four cubic quarter arcs, so the tube is a
+// little out of round. Normals point out of the tube.
+std::vector<rst::bezier_patch> torus_patches(float major, float minor)
+{
+    // Control points of the unit quarter circle arc k, from angle k * 90 degrees. The ends are
+    // exact, so that neighbouring arcs share them to the bit.
+    const float arc = 0.5523f;
+    static const Eigen::Vector2f axes[4] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+    auto quarter = [&](int k, int i) {
+        Eigen::Vector2f p0 = axes[k % 4], p3 = axes[(k + 1) % 4];
+        Eigen::Vector2f t0(-p0.y(), p0.x()), t1(-p3.y(), p3.x());
+        Eigen::Vector2f points[4] = {p0, p0 + arc * t0, p3 - arc * t1, p3};
+        return points[i];
+    };
+
+    std::vector<rst::bezier_patch> patches;
+    for (int ring = 0; ring < 4; ++ring)
+    {
+        for (int tube = 0; tube < 4; ++tube)
         {
-            Triangle* t = new Triangle();
-            for(int j=0;j<3;j++)
+            rst::bezier_patch patch;
+            for (int i = 0; i < 4; ++i)
             {
-                t->setVertex(j,Vector4f(mesh.Vertices[i+j].Position.X,mesh.Vertices[i+j].Position.Y,mesh.Vertices[i+j].Position.Z,1.0));
-                t->setNormal(j,Vector3f(mesh.Vertices[i+j].Normal.X,mesh.Vertices[i+j].Normal.Y,mesh.Vertices[i+j].Normal.Z));
-                t->setTexCoord(j,Vector2f(mesh.Vertices[i+j].TextureCoordinate.X, mesh.Vertices[i+j].TextureCoordinate.Y));
+                // Row i along the tube: distance from the axis and height
+                Eigen::Vector2f section = Eigen::Vector2f(major, 0) + minor * quarter(tube, i);
+                for (int j = 0; j < 4; ++j)
+                {
+                    Eigen::Vector2f around = quarter(ring, j);
+                    patch.control[4 * i + j] = {around.x() * section.x(), around.y() * section.x(), section.y()};
+                }
             }
-            TriangleList.push_back(t);
+            patches.push_back(patch);
         }
     }
+    return patches;
+}
 
-    rst::rasterizer r(700, 700);
-
-    auto texture_path = "hmap.jpg";
-    r.set_texture(Texture(obj_path + texture_path));
-
-    std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = phong_fragment_shader;
-
-    if (argc >= 2)
+// Renders a turntable of frames frames of each model in ../models with each shader, shadows
+// included, and writes where the rasterizer spent its time to json_file. Models are scaled to the
+// size of spot and drawn at full detail. Each shader is run on each of its draw paths, see
+// named_shader.
+int run_benchmark(const std::string& json_file, int frames)
+{
+    static const char* models[][2] = {
+        {"spot", "../models/spot/spot_triangulated_good.obj"},
+        {"bunny", "../models/bunny/bunny.obj"},
+        {"cube", "../models/cube/cube.obj"},
+        {"rock", "../models/rock/rock.obj"},
+    };
+    Texture height_map("../models/spot/hmap.jpg");
+    height_map.computeHeightGradients();
+    Texture spot_texture("../models/spot/spot_texture.png");
+    Eigen::Vector3f eye_pos = scene_eye_pos;
+    Eigen::Matrix4f view = get_view_matrix(eye_pos);
+    Eigen::Matrix4f projection = get_projection_matrix(45.0, 1, 0.1, 50);
+
+    std::ofstream json(json_file);
+    if (!json)
     {
-        command_line = true;
-        filename = std::string(argv[1]);
+        std::cerr << "could not write " << json_file << "\n";
+        return 1;
+    }
+    json << "{\n  \"width\": 700,\n  \"height\": 700,\n  \"threads\": " << std::max(1u, std::thread::hardware_concurrency())
+         << ",\n  \"frames\": " << frames << ",\n  \"runs\": [";
 
-        if (argc == 3 && std::string(argv[2]) == "texture")
+    bool first_run = true;
+    float spot_radius = 0;
+    for (const auto& model_file : models)
+    {
+        objl::Loader loader;
+        if (!loader.LoadFile(model_file[1]))
         {
-            std::cout << "Rasterizing using the texture shader\n";
-            active_shader = texture_fragment_shader;
-            texture_path = "spot_texture.png";
-            r.set_texture(Texture(obj_path + texture_path));
+            std::cerr << "could not load " << model_file[1] << "\n";
+            return 1;
         }
-        else if (argc == 3 && std::string(argv[2]) == "normal")
+        rst::indexed_mesh mesh = weld_vertices(loader.LoadedMeshes);
+
+        rst::rasterizer r(700, 700);
+        auto pos_id = r.load_positions(mesh.positions);
+        auto ind_id = r.load_indices(mesh.indices);
+        auto col_id = r.load_colors(std::vector<Eigen::Vector3f>(mesh.positions.size(), {148, 121, 92}));
+        r.load_normals(mesh.normals);
+        r.load_texcoords(mesh.texcoords);
+        r.set_vertex_shader(vertex_shader);
+        r.set_near_plane(0.1);
+        r.set_face_culling(rst::Cull::Back);
+        r.set_lights(scene_lights);
+        r.set_view(view);
+        r.set_projection(projection);
+        r.set_profiling(true);
+
+        rst::rasterizer shadow_pass(512, 512);
+        auto shadow_pos_id = shadow_pass.load_positions(mesh.positions);
+        auto shadow_ind_id = shadow_pass.load_indices(mesh.indices);
+        shadow_pass.set_face_culling(rst::Cull::Back);
+
+        // Centered on its bounding sphere and scaled to the radius of spot's
+        const Eigen::Vector4f& sphere = r.bounding_sphere(pos_id);
+        if (spot_radius == 0)
+            spot_radius = sphere.w();
+        Eigen::Matrix4f fit = Eigen::Matrix4f::Identity();
+        fit.topLeftCorner<3, 3>() *= spot_radius / sphere.w();
+        fit.col(3).head<3>() = -sphere.head<3>() * spot_radius / sphere.w();
+
+        // One run of the current shader, drawing each frame with draw_frame()
+        auto time_run = [&](const named_shader& shader, const char* path, auto&& draw_frame) {
+            rst::stage_stats total;
+            int64_t triangles = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int k = 0; k < frames; ++k)
+            {
+                Eigen::Matrix4f model = get_model_matrix(140.0f + 360.0f * k / frames) * fit;
+                r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+                r.set_model(model);
+                if (shader.shadowed)
+                    r.set_shadow_maps(render_shadow_maps(shadow_pass, shadow_pos_id, shadow_ind_id, model, view));
+                draw_frame();
+
+                rst::stage_stats frame = r.profile();
+                total.vertex += frame.vertex;
+                total.setup += frame.setup;
+                total.raster += frame.raster;
+                total.shading += frame.shading;
+                total.resolve += frame.resolve;
+                total.fragments_shaded += frame.fragments_shaded;
+                total.pixels_covered += frame.pixels_covered;
+                triangles += r.culling_stats().submitted;
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double draw_seconds = total.vertex + total.setup + total.raster + total.shading + total.resolve;
+            double overdraw = total.pixels_covered > 0 ? (double)total.fragments_shaded / total.pixels_covered : 0;
+
+            std::cout << model_file[0] << " / " << shader.name << " / " << path << ": " << 1000 * seconds / frames << " ms per frame, "
+                      << 1000 * draw_seconds / frames << " ms in draw(), overdraw " << overdraw << "\n";
+            json << (first_run ? "" : ",") << "\n    {\"model\": \"" << model_file[0] << "\", \"shader\": \"" << shader.name
+                 << "\", \"path\": \"" << path << "\", \"triangles\": " << mesh.indices.size() << ",\n     \"frame_ms\": " << 1000 * seconds / frames
+                 << ", \"stage_ms\": {\"vertex\": " << 1000 * total.vertex / frames
+                 << ", \"setup\": " << 1000 * total.setup / frames
+                 << ", \"raster\": " << 1000 * total.raster / frames
+                 << ", \"shading\": " << 1000 * total.shading / frames
+                 << ", \"resolve\": " << 1000 * total.resolve / frames << "},"
+                 << "\n     \"fragments_shaded\": " << total.fragments_shaded / frames
+                 << ", \"pixels_covered\": " << total.pixels_covered / frames
+                 << ", \"overdraw\": " << overdraw
+                 << ", \"triangles_per_second\": " << (draw_seconds > 0 ? triangles / draw_seconds : 0) << "}";
+            first_run = false;
+        };
+
+        // Every draw path a shader has: quads, the scalar shader through std::function, and the
+        // scalar shader inlined
+        for (const auto& shader : named_shaders)
         {
-            std::cout << "Rasterizing using the normal shader\n";
-            active_shader = normal_fragment_shader;
+            r.set_texture(shader.textured ? spot_texture : height_map);
+            r.set_fragment_shader(shader.scalar);
+            r.set_shadow_maps({});
+            if (shader.quad)
+                time_run(shader, "quad", [&] { r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, shader.quad); });
+            time_run(shader, "function", [&] { r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle); });
+            if (shader.inlined)
+                time_run(shader, "inlined", [&] { shader.inlined(r, pos_id, ind_id, col_id); });
         }
-        else if (argc == 3 && std::string(argv[2]) == "phong")
+    }
+    json << "\n  ]\n}\n";
+    return json ? 0 : 1;
+}
+
+int main(int argc, const char** argv)
+{
+    float angle = 140.0;
+    bool command_line = false;
+
+    std::string filename = "output.png";
+    objl::Loader Loader;
+    std::string obj_path = "../models/spot/";
+
+    // Load .obj File
+    std::string obj_file = obj_path + "spot_triangulated_good.obj";
+    bool loadout = Loader.LoadFile(obj_file);
+    // 简化出的各级 LOD 缓存在模型旁边，只在模型变了之后重新生成
+    rst::lod_chain lods = rst::load_lod_chain(weld_vertices(Loader.LoadedMeshes), obj_file + ".lod");
+    const rst::indexed_mesh& mesh = lods.mesh;
+    std::cout << lods.levels.size() << " levels of detail:";
+    for (const auto& level : lods.levels)
+        std::cout << " " << level.indices.size();
+    std::cout << " triangles\n";
+
+    rst::rasterizer r(700, 700);
+
+    auto pos_id = r.load_positions(mesh.positions);
+    auto ind_id = r.load_lods(lods.levels);
+    auto col_id = r.load_colors(std::vector<Eigen::Vector3f>(mesh.positions.size(), {148, 121, 92}));
+    r.load_normals(mesh.normals);
+    r.load_texcoords(mesh.texcoords);
+
+    auto texture_path = "hmap.jpg";
+    Texture height_map(obj_path + texture_path);
+    // bump / displacement 着色器读取预先算好的高度梯度
+    height_map.computeHeightGradients();
+    r.set_texture(height_map);
+
+    // 阴影图的深度 pass，每帧从每个光源画一遍
+    rst::rasterizer shadow_pass(512, 512);
+    auto shadow_pos_id = shadow_pass.load_positions(mesh.positions);
+    auto shadow_ind_id = shadow_pass.load_lods(lods.levels);
+    // 闭合网格离光源最近的总是正面
+    shadow_pass.set_face_culling(rst::Cull::Back);
+
+    std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = phong_fragment_shader;
+    // Shaders with a quad version are drawn through it; active_shader is used when this is null
+    quad3f (*active_quad_shader)(const fragment_quad_payload&) = phong_quad_shader;
+    bool active_shadowed = true;
+
+    // Rasterizer [options] <output> [shader], with the options
+    //   --batch <frames>  render a turntable of <frames> frames headless, written to
+    //                     <output>0000.png, <output>0001.png, ...
+    //   --lights <n>      add n small colored point lights close to the surface of the model
+    //   --distance <d>    put the camera d units away from the model instead of 10
+    //   --lod <pixels>    screen-space error allowed to the levels of detail, 0 for full detail
+    //   --crowd <n>       draw n more cows behind the first one, see crowd_objects()
+    //   --patches <pixels>  draw a torus of Bezier patches instead, tessellated every frame to
+    //                       triangle edges of at most <pixels> on screen
+    //   --benchmark <json>  render every model with every shader instead, see run_benchmark();
+    //                       --batch sets the number of frames per run, 16 by default
+    int batch_frames = 0;
+    int extra_lights = 0;
+    float eye_distance = 10;
+    std::string benchmark_file;
+    int crowd = 0;
+    float patch_pixels = 0;
+    int arg = 1;
+    while (arg + 1 < argc && std::string(argv[arg]).rfind("--", 0) == 0)
+    {
+        std::string option = argv[arg];
+        if (option == "--batch")
+            batch_frames = std::max(1, std::atoi(argv[arg + 1]));
+        else if (option == "--lights")
+            extra_lights = std::max(0, std::atoi(argv[arg + 1]));
+        else if (option == "--benchmark")
+            benchmark_file = argv[arg + 1];
+        else if (option == "--crowd")
+            crowd = std::max(0, std::atoi(argv[arg + 1]));
+        else if (option == "--patches")
+            patch_pixels = (float)std::atof(argv[arg + 1]);
+        else if (option == "--distance")
+            eye_distance = (float)std::atof(argv[arg + 1]);
+        else if (option == "--lod")
         {
-            std::cout << "Rasterizing using the phong shader\n";
-            active_shader = phong_fragment_shader;
+            r.set_lod_threshold((float)std::atof(argv[arg + 1]));
+            shadow_pass.set_lod_threshold((float)std::atof(argv[arg + 1]));
         }
-        else if (argc == 3 && std::string(argv[2]) == "bump")
+        else
         {
-            std::cout << "Rasterizing using the bump shader\n";
-            active_shader = bump_fragment_shader;
+            std::cerr << "unknown option " << option << "\n";
+            return 1;
         }
-        else if (argc == 3 && std::string(argv[2]) == "displacement")
+        arg += 2;
+    }
+
+    if (!benchmark_file.empty())
+        return run_benchmark(benchmark_file, batch_frames > 0 ? batch_frames : 16);
+
+    // 曲面片按当前视角重新细分，阴影用一份固定细分（模型空间里边长 0.1）的网格
+    rst::patch_tessellator torus(torus_patches(0.7f, 0.28f));
+    if (patch_pixels > 0)
+    {
+        rst::indexed_mesh shadow_mesh;
+        torus.tessellate(Eigen::Matrix4f::Identity(), 0.1f, shadow_mesh);
+        shadow_pos_id = shadow_pass.load_positions(shadow_mesh.positions);
+        shadow_ind_id = shadow_pass.load_indices(shadow_mesh.indices);
+    }
+    auto scene_objects = [&](const Eigen::Matrix4f& model) {
+        if (patch_pixels <= 0)
+            return crowd_objects(pos_id, ind_id, col_id, model, crowd);
+        r.set_model(model);
+        return std::vector<rst::draw_object>{r.load_patches(torus, patch_pixels, {148, 121, 92})};
+    };
+
+    if (argc > arg)
+    {
+        command_line = true;
+        filename = std::string(argv[arg]);
+        std::string shader = argc == arg + 2 ? argv[arg + 1] : "";
+
+        for (const auto& entry : named_shaders)
         {
-            std::cout << "Rasterizing using the bump shader\n";
-            active_shader = displacement_fragment_shader;
+            if (shader != entry.name)
+                continue;
+            std::cout << "Rasterizing using the " << entry.name << " shader\n";
+            active_shader = entry.scalar;
+            active_quad_shader = entry.quad;
+            active_shadowed = entry.shadowed;
+            if (entry.textured)
+            {
+                texture_path = "spot_texture.png";
+                r.set_texture(Texture(obj_path + texture_path));
+            }
         }
     }
 
-    Eigen::Vector3f eye_pos = {0,0,10};
+    Eigen::Vector3f eye_pos = {0,0,eye_distance};
 
     r.set_vertex_shader(vertex_shader);
     r.set_fragment_shader(active_shader);
+    // zNear of the projection below
+    r.set_near_plane(0.1);
+    // 奶牛是封闭网格，背面总被正面挡住
+    r.set_face_culling(rst::Cull::Back);
+
+    std::vector<light> lights = scene_lights;
+    std::vector<light> extra = scatter_lights(mesh, get_view_matrix(eye_pos) * get_model_matrix(angle), extra_lights);
+    lights.insert(lights.end(), extra.begin(), extra.end());
+    r.set_lights(lights);
+
+    // 只有采样阴影图的着色器才每帧画阴影的深度 pass
+    auto update_shadow_maps = [&](const Eigen::Matrix4f& model) {
+        if (active_shadowed)
+            r.set_shadow_maps(render_shadow_maps(shadow_pass, shadow_pos_id, shadow_ind_id, model, get_view_matrix(eye_pos)));
+    };
 
     int key = 0;
     int frame_count = 0;
 
+    if (batch_frames > 0)
+    {
+        r.set_view(get_view_matrix(eye_pos));
+        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+
+        // PNG 编码交给写线程，和下一帧的光栅化重叠；两边分掉硬件线程，避免超额订阅
+        int hardware_threads = std::max(1, (int)std::thread::hardware_concurrency());
+        int writer_threads = std::max(1, hardware_threads / 2);
+        r.set_thread_count(hardware_threads - writer_threads);
+        shadow_pass.set_thread_count(hardware_threads - writer_threads);
+        frame_writer writer(writer_threads, 4);
+        auto start = std::chrono::steady_clock::now();
+        for (int k = 0; k < batch_frames; ++k)
+        {
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            Eigen::Matrix4f model = get_model_matrix(angle + 360.0f * k / batch_frames);
+            r.set_model(model);
+            update_shadow_maps(model);
+            auto objects = scene_objects(model);
+
+            if (active_quad_shader)
+                r.draw_objects(objects, active_quad_shader);
+            else
+                r.draw_objects(objects);
+
+            char number[16];
+            std::snprintf(number, sizeof(number), "%04d.png", k);
+            // The next frame is drawn into the same framebuffer, so the writer gets a copy
+            writer.push(filename + number, r.frame_buffer().image().clone());
+        }
+        writer.finish();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "rendered " << batch_frames << " frames in " << seconds << " s ("
+                  << batch_frames / seconds << " frames/s)\n";
+        if (writer.failed() > 0)
+        {
+            std::cerr << "failed to write " << writer.failed() << " frames\n";
+            return 1;
+        }
+        return 0;
+    }
+
     if (command_line)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
         r.set_model(get_model_matrix(angle));
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+        update_shadow_maps(get_model_matrix(angle));
+        auto objects = scene_objects(get_model_matrix(angle));
 
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        if (active_quad_shader)
+            r.draw_objects(objects, active_quad_shader);
+        else
+            r.draw_objects(objects);
+        cv::Mat image = r.frame_buffer().image();
 
         cv::imwrite(filename, image);
 
+        const auto& culled = r.culling_stats();
+        std::cout << "culled " << culled.frustum + culled.back_face + culled.occluded << " of " << culled.submitted
+                  << " triangles (frustum " << culled.frustum << ", back-face " << culled.back_face
+                  << ", occluded " << culled.occluded << ")\n";
+
         return 0;
     }
 
@@ -537,12 +1220,14 @@ int main(int argc, const char** argv)
         r.set_model(get_model_matrix(angle));
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+        update_shadow_maps(get_model_matrix(angle));
+        auto objects = scene_objects(get_model_matrix(angle));
 
-        //r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        if (active_quad_shader)
+            r.draw_objects(objects, active_quad_shader);
+        else
+            r.draw_objects(objects);
+        cv::Mat image = r.frame_buffer().image();
 
         cv::imshow("image", image);
         cv::imwrite(filename, image);
@@ -556,6 +1241,14 @@ int main(int argc, const char** argv)
         {
             angle += 0.1;
         }
+        else if (key == 'w')
+        {
+            eye_pos.z() = std::max(1.0f, eye_pos.z() - 1);
+        }
+        else if (key == 's')
+        {
+            eye_pos.z() += 1;
+        }
 
     }
     return 0;
@@ -0,0 +1,401 @@
+//
+// Discrete levels of detail of indexed meshes, built by quadric error metric simplification.
+//
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <queue>
+#include "mesh_lod.hpp"
+
+namespace
+{
+    // Half-edge collapse of vertex u into vertex v, as queued by its cost. The versions are those of
+    // u and v when the entry was queued; an entry whose vertices changed since then is stale.
+    struct collapse
+    {
+        double cost;
+        float error;
+        int u, v;
+        int version_u, version_v;
+
+        bool operator>(const collapse& other) const { return cost > other.cost; }
+    };
+
+    class simplifier
+    {
+    public:
+        simplifier(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3i>& indices)
+            : positions(positions), tris(indices), tri_alive(indices.size(), true), live_tris((int)indices.size()),
+              vertex_tris(positions.size()), quadrics(positions.size(), Eigen::Matrix4d::Zero()),
+              areas(positions.size(), 0.0), locked(positions.size(), false), removed(positions.size(), false),
+              version(positions.size(), 0)
+        {
+            for (int t = 0; t < (int)tris.size(); ++t)
+                for (int j = 0; j < 3; ++j)
+                    vertex_tris[tris[t][j]].push_back(t);
+
+            // Error quadrics: the planes of the triangles around each vertex, weighted by area
+            for (const auto& tri : tris)
+            {
+                Eigen::Vector3d a = positions[tri[0]].cast<double>();
+                Eigen::Vector3d n = (positions[tri[1]].cast<double>() - a).cross(positions[tri[2]].cast<double>() - a);
+                double area = 0.5 * n.norm();
+                if (area == 0)
+                    continue;
+                Eigen::Vector4d plane;
+                plane << n.normalized(), -n.normalized().dot(a);
+                Eigen::Matrix4d q = area * plane * plane.transpose();
+                for (int j = 0; j < 3; ++j)
+                {
+                    quadrics[tri[j]] += q;
+                    areas[tri[j]] += area;
+                }
+            }
+
+            lock_borders_and_seams();
+
+            for (int u = 0; u < (int)positions.size(); ++u)
+                for (int v : neighbors(u))
+                    push(u, v);
+        }
+
+        int triangle_count() const { return live_tris; }
+        float error() const { return max_error; }
+
+        // Collapses the cheapest valid edges until at most target triangles are left or no edge can
+        // be collapsed. Returns false in the latter case.
+        bool reduce_to(int target)
+        {
+            while (live_tris > target)
+            {
+                if (queue.empty())
+                    return false;
+                collapse c = queue.top();
+                queue.pop();
+                if (removed[c.u] || removed[c.v] || version[c.u] != c.version_u || version[c.v] != c.version_v)
+                    continue;
+                if (!can_collapse(c.u, c.v))
+                    continue;
+                apply(c);
+            }
+            return true;
+        }
+
+        std::vector<Eigen::Vector3i> indices() const
+        {
+            std::vector<Eigen::Vector3i> out;
+            out.reserve(live_tris);
+            for (size_t t = 0; t < tris.size(); ++t)
+                if (tri_alive[t])
+                    out.push_back(tris[t]);
+            return out;
+        }
+
+    private:
+        // Vertices sharing their position with another vertex lie on an attribute seam; vertices of
+        // edges that do not have exactly two triangles lie on a border or a non-manifold edge. Both
+        // are compared by position, so a seam does not count as a border.
+        void lock_borders_and_seams()
+        {
+            std::map<std::array<float, 3>, int> position_ids;
+            std::vector<int> position_id(positions.size());
+            std::vector<int> copies;
+            for (size_t i = 0; i < positions.size(); ++i)
+            {
+                auto it = position_ids.emplace(std::array<float, 3>{positions[i].x(), positions[i].y(), positions[i].z()}, (int)copies.size());
+                if (it.second)
+                    copies.push_back(0);
+                position_id[i] = it.first->second;
+                copies[position_id[i]]++;
+            }
+
+            std::map<std::pair<int, int>, int> edge_tris;
+            for (const auto& tri : tris)
+            {
+                for (int j = 0; j < 3; ++j)
+                {
+                    int a = position_id[tri[j]], b = position_id[tri[(j + 1) % 3]];
+                    edge_tris[{std::min(a, b), std::max(a, b)}]++;
+                }
+            }
+            std::vector<bool> locked_position(copies.size(), false);
+            for (const auto& edge : edge_tris)
+            {
+                if (edge.second != 2)
+                {
+                    locked_position[edge.first.first] = true;
+                    locked_position[edge.first.second] = true;
+                }
+            }
+
+            for (size_t i = 0; i < positions.size(); ++i)
+                locked[i] = copies[position_id[i]] > 1 || locked_position[position_id[i]];
+        }
+
+        std::vector<int> neighbors(int u) const
+        {
+            std::vector<int> out;
+            for (int t : vertex_tris[u])
+            {
+                if (!tri_alive[t])
+                    continue;
+                for (int j = 0; j < 3; ++j)
+                    if (tris[t][j] != u)
+                        out.push_back(tris[t][j]);
+            }
+            std::sort(out.begin(), out.end());
+            out.erase(std::unique(out.begin(), out.end()), out.end());
+            return out;
+        }
+
+        void push(int u, int v)
+        {
+            if (locked[u])
+                return;
+            Eigen::Vector4d p = positions[v].cast<double>().homogeneous();
+            double cost = std::max(0.0, p.dot((quadrics[u] + quadrics[v]) * p));
+            double area = areas[u] + areas[v];
+            float error = area > 0 ? (float)std::sqrt(cost / area) : 0.0f;
+            queue.push({cost, error, u, v, version[u], version[v]});
+        }
+
+        bool can_collapse(int u, int v) const
+        {
+            // Link condition: the only vertices next to both u and v are the third vertices of the
+            // triangles on the edge, otherwise the collapse would pinch the surface
+            int shared_tris = 0;
+            for (int t : vertex_tris[u])
+                if (tri_alive[t] && (tris[t][0] == v || tris[t][1] == v || tris[t][2] == v))
+                    shared_tris++;
+            if (shared_tris == 0)
+                return false;
+            std::vector<int> nu = neighbors(u), nv = neighbors(v), common;
+            std::set_intersection(nu.begin(), nu.end(), nv.begin(), nv.end(), std::back_inserter(common));
+            if ((int)common.size() != shared_tris)
+                return false;
+
+            // No remaining triangle of u may flip over or turn edge-on when u moves to v
+            for (int t : vertex_tris[u])
+            {
+                if (!tri_alive[t])
+                    continue;
+                const Eigen::Vector3i& tri = tris[t];
+                if (tri[0] == v || tri[1] == v || tri[2] == v)
+                    continue;
+                std::array<Eigen::Vector3f, 3> p = {positions[tri[0]], positions[tri[1]], positions[tri[2]]};
+                Eigen::Vector3f before = (p[1] - p[0]).cross(p[2] - p[0]);
+                for (int j = 0; j < 3; ++j)
+                    if (tri[j] == u)
+                        p[j] = positions[v];
+                Eigen::Vector3f after = (p[1] - p[0]).cross(p[2] - p[0]);
+                if (before.dot(after) <= 0.2f * before.norm() * after.norm())
+                    return false;
+            }
+            return true;
+        }
+
+        void apply(const collapse& c)
+        {
+            int u = c.u, v = c.v;
+            for (int t : vertex_tris[u])
+            {
+                if (!tri_alive[t])
+                    continue;
+                Eigen::Vector3i& tri = tris[t];
+                if (tri[0] == v || tri[1] == v || tri[2] == v)
+                {
+                    tri_alive[t] = false;
+                    live_tris--;
+                    continue;
+                }
+                for (int j = 0; j < 3; ++j)
+                    if (tri[j] == u)
+                        tri[j] = v;
+                vertex_tris[v].push_back(t);
+            }
+            vertex_tris[u].clear();
+            auto& v_tris = vertex_tris[v];
+            v_tris.erase(std::remove_if(v_tris.begin(), v_tris.end(), [&](int t) { return !tri_alive[t]; }), v_tris.end());
+
+            removed[u] = true;
+            quadrics[v] += quadrics[u];
+            areas[v] += areas[u];
+            version[v]++;
+            max_error = std::max(max_error, c.error);
+
+            for (int n : neighbors(v))
+            {
+                push(v, n);
+                push(n, v);
+            }
+        }
+
+        const std::vector<Eigen::Vector3f>& positions;
+        std::vector<Eigen::Vector3i> tris;
+        std::vector<bool> tri_alive;
+        int live_tris;
+        std::vector<std::vector<int>> vertex_tris;
+        std::vector<Eigen::Matrix4d> quadrics;
+        std::vector<double> areas;
+        std::vector<bool> locked;
+        std::vector<bool> removed;
+        std::vector<int> version;
+        std::priority_queue<collapse, std::vector<collapse>, std::greater<collapse>> queue;
+        float max_error = 0;
+    };
+
+    constexpr uint32_t cache_magic = 0x31444f4c;  // "LOD1"
+
+    // FNV-1a over the mesh data and the parameters, to tell whether a cache file was built from them
+    uint64_t mesh_hash(const rst::indexed_mesh& mesh, int min_triangles)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto add = [&](const void* data, size_t size) {
+            for (size_t i = 0; i < size; ++i)
+                hash = (hash ^ static_cast<const uint8_t*>(data)[i]) * 1099511628211ull;
+        };
+        add(mesh.positions.data(), mesh.positions.size() * sizeof(Eigen::Vector3f));
+        add(mesh.normals.data(), mesh.normals.size() * sizeof(Eigen::Vector3f));
+        add(mesh.texcoords.data(), mesh.texcoords.size() * sizeof(Eigen::Vector2f));
+        add(mesh.indices.data(), mesh.indices.size() * sizeof(Eigen::Vector3i));
+        add(&min_triangles, sizeof(min_triangles));
+        return hash;
+    }
+
+    template <typename T>
+    void write_array(std::ofstream& out, const std::vector<T>& data)
+    {
+        uint32_t size = (uint32_t)data.size();
+        out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        out.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(T));
+    }
+
+    template <typename T>
+    bool read_array(std::ifstream& in, std::vector<T>& data)
+    {
+        uint32_t size = 0;
+        if (!in.read(reinterpret_cast<char*>(&size), sizeof(size)))
+            return false;
+        data.resize(size);
+        return (bool)in.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(T));
+    }
+
+    bool read_cache(const std::string& filename, uint64_t hash, rst::lod_chain& chain)
+    {
+        std::ifstream in(filename, std::ios::binary);
+        uint32_t magic = 0, num_levels = 0;
+        uint64_t file_hash = 0;
+        if (!in.read(reinterpret_cast<char*>(&magic), sizeof(magic)) || magic != cache_magic)
+            return false;
+        if (!in.read(reinterpret_cast<char*>(&file_hash), sizeof(file_hash)) || file_hash != hash)
+            return false;
+        if (!read_array(in, chain.mesh.positions) || !read_array(in, chain.mesh.normals) ||
+            !read_array(in, chain.mesh.texcoords) || !in.read(reinterpret_cast<char*>(&num_levels), sizeof(num_levels)))
+            return false;
+        chain.levels.resize(num_levels);
+        for (auto& level : chain.levels)
+        {
+            if (!in.read(reinterpret_cast<char*>(&level.vertex_count), sizeof(level.vertex_count)) ||
+                !in.read(reinterpret_cast<char*>(&level.error), sizeof(level.error)) || !read_array(in, level.indices))
+                return false;
+        }
+        if (chain.levels.empty())
+            return false;
+        chain.mesh.indices = chain.levels[0].indices;
+        return true;
+    }
+
+    bool write_cache(const std::string& filename, uint64_t hash, const rst::lod_chain& chain)
+    {
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        uint32_t num_levels = (uint32_t)chain.levels.size();
+        out.write(reinterpret_cast<const char*>(&cache_magic), sizeof(cache_magic));
+        out.write(reinterpret_cast<const char*>(&hash), sizeof(hash));
+        write_array(out, chain.mesh.positions);
+        write_array(out, chain.mesh.normals);
+        write_array(out, chain.mesh.texcoords);
+        out.write(reinterpret_cast<const char*>(&num_levels), sizeof(num_levels));
+        for (const auto& level : chain.levels)
+        {
+            out.write(reinterpret_cast<const char*>(&level.vertex_count), sizeof(level.vertex_count));
+            out.write(reinterpret_cast<const char*>(&level.error), sizeof(level.error));
+            write_array(out, level.indices);
+        }
+        return (bool)out;
+    }
+}
+
+rst::lod_chain rst::build_lod_chain(const indexed_mesh& mesh, int min_triangles)
+{
+    std::vector<lod_level> levels(1);
+    levels[0].indices = mesh.indices;
+
+    simplifier simplify(mesh.positions, mesh.indices);
+    while ((int)levels.back().indices.size() > min_triangles)
+    {
+        int current = (int)levels.back().indices.size();
+        bool done = !simplify.reduce_to(std::max(current / 2, min_triangles));
+        // Stop at levels that barely differ from the previous one
+        if (simplify.triangle_count() > current * 9 / 10)
+            break;
+        lod_level level;
+        level.indices = simplify.indices();
+        level.error = simplify.error();
+        levels.push_back(std::move(level));
+        if (done)
+            break;
+    }
+
+    // Order the vertices by the coarsest level that still uses them, so that every level uses a
+    // prefix of the vertex buffers. Vertices no level uses go last.
+    int num_verts = (int)mesh.positions.size();
+    std::vector<int> coarsest(num_verts, -1);
+    for (int k = 0; k < (int)levels.size(); ++k)
+        for (const auto& tri : levels[k].indices)
+            for (int j = 0; j < 3; ++j)
+                coarsest[tri[j]] = k;
+    std::vector<int> order(num_verts);
+    for (int i = 0; i < num_verts; ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return coarsest[a] > coarsest[b]; });
+
+    lod_chain chain;
+    std::vector<int> new_index(num_verts);
+    for (int i = 0; i < num_verts; ++i)
+    {
+        int old = order[i];
+        new_index[old] = i;
+        chain.mesh.positions.push_back(mesh.positions[old]);
+        if ((int)mesh.normals.size() == num_verts)
+            chain.mesh.normals.push_back(mesh.normals[old]);
+        if ((int)mesh.texcoords.size() == num_verts)
+            chain.mesh.texcoords.push_back(mesh.texcoords[old]);
+    }
+    for (int k = 0; k < (int)levels.size(); ++k)
+    {
+        for (auto& tri : levels[k].indices)
+            tri = Eigen::Vector3i(new_index[tri[0]], new_index[tri[1]], new_index[tri[2]]);
+        levels[k].vertex_count = (int)std::count_if(coarsest.begin(), coarsest.end(), [&](int c) { return c >= k; });
+    }
+    chain.mesh.indices = levels[0].indices;
+    chain.levels = std::move(levels);
+    return chain;
+}
+
+rst::lod_chain rst::load_lod_chain(const indexed_mesh& mesh, const std::string& cache_file, int min_triangles)
+{
+    uint64_t hash = mesh_hash(mesh, min_triangles);
+    lod_chain chain;
+    if (read_cache(cache_file, hash, chain))
+        return chain;
+
+    chain = build_lod_chain(mesh, min_triangles);
+    if (!write_cache(cache_file, hash, chain))
+        std::cerr << "could not write the level of detail cache " << cache_file << "\n";
+    return chain;
+}
@@ -0,0 +1,52 @@
+//
+// Discrete levels of detail of indexed meshes, built by quadric error metric simplification.
+//
+
+#pragma once
+
+#include <eigen3/Eigen/Eigen>
+#include <string>
+#include <vector>
+
+namespace rst
+{
+    // Indexed triangle mesh for the indexed draw path of rst::rasterizer
+    struct indexed_mesh
+    {
+        std::vector<Eigen::Vector3f> positions;
+        std::vector<Eigen::Vector3f> normals;
+        std::vector<Eigen::Vector2f> texcoords;
+        std::vector<Eigen::Vector3i> indices;
+    };
+
+    struct lod_level
+    {
+        std::vector<Eigen::Vector3i> indices;
+        // The level only references vertices [0, vertex_count) of the chain's mesh
+        int vertex_count = 0;
+        // Largest RMS distance, in model units, between a collapsed vertex and the planes of the
+        // original triangles merged into it
+        float error = 0;
+    };
+
+    // A mesh and successively coarser index buffers over its vertices. Levels are made by half-edge
+    // collapses, which keep the surviving vertices as they are, so every level can be drawn with the
+    // vertex buffers of the full mesh. The vertices are ordered by the coarsest level they survive
+    // to, so each level uses a prefix of them. levels[0] is the full mesh, with an error of 0.
+    struct lod_chain
+    {
+        indexed_mesh mesh;
+        std::vector<lod_level> levels;
+    };
+
+    // Halves the triangle count from level to level until a level has at most min_triangles
+    // triangles or no further collapse is possible. Vertices on borders, on non-manifold edges and
+    // on attribute seams (vertices at the same position with different normals or texcoords) are
+    // never moved, so the outline and the texture seams of the mesh are kept.
+    lod_chain build_lod_chain(const indexed_mesh& mesh, int min_triangles = 64);
+
+    // Same as build_lod_chain(), but reads the chain from cache_file if the file was made from the
+    // same mesh, and otherwise builds it and writes it there. A file that cannot be written is
+    // reported on std::cerr and otherwise ignored.
+    lod_chain load_lod_chain(const indexed_mesh& mesh, const std::string& cache_file, int min_triangles = 64);
+}
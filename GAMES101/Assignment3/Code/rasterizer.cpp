@@ -3,6 +3,9 @@
 //
 
 #include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
@@ -12,10 +15,39 @@ rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3
 {
     auto id = get_next_id();
     pos_buf.emplace(id, positions);
+    update_bounds(id);
 
     return {id};
 }
 
+void rst::rasterizer::update_bounds(int pos_id)
+{
+    const std::vector<Eigen::Vector3f>& positions = pos_buf.at(pos_id);
+
+    // Bounding sphere centered on the bounding box, for frustum culling of the whole buffer
+    Eigen::Vector4f bounds = Eigen::Vector4f::Zero();
+    if (!positions.empty())
+    {
+        Eigen::Vector3f lo = positions[0], hi = positions[0];
+        for (const auto& p : positions)
+        {
+            lo = lo.cwiseMin(p);
+            hi = hi.cwiseMax(p);
+        }
+        Eigen::Vector3f center = (lo + hi) / 2;
+        float radius = 0;
+        for (const auto& p : positions)
+            radius = std::max(radius, (p - center).norm());
+        bounds << center, radius;
+        pos_boxes.insert_or_assign(pos_id, Eigen::AlignedBox3f(lo, hi));
+    }
+    else
+    {
+        pos_boxes.insert_or_assign(pos_id, Eigen::AlignedBox3f());
+    }
+    pos_bounds.insert_or_assign(pos_id, bounds);
+}
+
 rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
 {
     auto id = get_next_id();
@@ -24,6 +56,17 @@ rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i>
     return {id};
 }
 
+rst::ind_buf_id rst::rasterizer::load_lods(const std::vector<lod_level>& levels)
+{
+    std::vector<lod_entry> chain;
+    for (const auto& level : levels)
+        chain.push_back({load_indices(level.indices).ind_id, level.vertex_count, level.error});
+    if (chain.empty())
+        return load_indices({});
+    lods.emplace(chain[0].ind_id, chain);
+    return {chain[0].ind_id};
+}
+
 rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
 {
     auto id = get_next_id();
@@ -42,6 +85,40 @@ rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>
     return {id};
 }
 
+rst::tex_buf_id rst::rasterizer::load_texcoords(const std::vector<Eigen::Vector2f>& texcoords)
+{
+    auto id = get_next_id();
+    tex_buf.emplace(id, texcoords);
+
+    texcoord_id = id;
+
+    return {id};
+}
+
+rst::draw_object rst::rasterizer::load_patches(const patch_tessellator& patches, float edge_pixels, const Eigen::Vector3f& color)
+{
+    if (patch_buffers.pos < 0)
+    {
+        patch_buffers = {get_next_id(), get_next_id(), get_next_id(), get_next_id(), get_next_id()};
+        pos_buf.emplace(patch_buffers.pos, std::vector<Eigen::Vector3f>());
+        ind_buf.emplace(patch_buffers.ind, std::vector<Eigen::Vector3i>());
+        col_buf.emplace(patch_buffers.col, std::vector<Eigen::Vector3f>());
+        nor_buf.emplace(patch_buffers.nor, std::vector<Eigen::Vector3f>());
+        tex_buf.emplace(patch_buffers.tex, std::vector<Eigen::Vector2f>());
+    }
+
+    patches.tessellate(viewport() * projection * view * model, edge_pixels, patch_mesh);
+    // The buffers of the previous call go back to patch_mesh, whose storage the next call refills
+    pos_buf[patch_buffers.pos].swap(patch_mesh.positions);
+    ind_buf[patch_buffers.ind].swap(patch_mesh.indices);
+    nor_buf[patch_buffers.nor].swap(patch_mesh.normals);
+    tex_buf[patch_buffers.tex].swap(patch_mesh.texcoords);
+    col_buf[patch_buffers.col].assign(pos_buf[patch_buffers.pos].size(), color);
+    update_bounds(patch_buffers.pos);
+
+    return {{patch_buffers.pos}, {patch_buffers.ind}, {patch_buffers.col}, model, {patch_buffers.nor}, {patch_buffers.tex}};
+}
+
 
 // Bresenham's line drawing algorithm
 void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
@@ -149,187 +226,641 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static bool insideTriangle(int x, int y, const Vector4f* _v){
-    Vector3f v[3];
-    for(int i=0;i<3;i++)
-        v[i] = {_v[i].x(),_v[i].y(), 1.0};
-    Vector3f f0,f1,f2;
-    f0 = v[1].cross(v[0]);
-    f1 = v[2].cross(v[1]);
-    f2 = v[0].cross(v[2]);
-    Vector3f p(x,y,1.);
-    if((p.dot(f0)*f0.dot(v[2])>0) && (p.dot(f1)*f1.dot(v[0])>0) && (p.dot(f2)*f2.dot(v[1])>0))
-        return true;
-    return false;
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
+{
+    draw(pos_buffer, ind_buffer, col_buffer, type, fragment_shader);
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f* v){
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList)
+{
+    draw(TriangleList, fragment_shader);
 }
 
-void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+void rst::rasterizer::draw_objects(const std::vector<draw_object>& objects)
+{
+    draw_objects(objects, fragment_shader);
+}
 
-    float f1 = (50 - 0.1) / 2.0;
-    float f2 = (50 + 0.1) / 2.0;
+bool rst::rasterizer::occluded(pos_buf_id pos_buffer) const
+{
+    const Eigen::AlignedBox3f& box = pos_boxes.at(pos_buffer.pos_id);
+    if (box.isEmpty())
+        return true;
 
     Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto& t:TriangleList)
+    Eigen::Vector4f corners[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        Eigen::Vector4f clip = mvp * box.corner((Eigen::AlignedBox3f::CornerType)i).homogeneous();
+        if (w_sign * clip.w() < near_plane)
+            return false;
+        corners[i] = to_screen(clip);
+    }
+
+    // Corner i has the x of bit 0, the y of bit 1 and the z of bit 2. All twelve triangles are
+    // tested, there being no point in telling the front faces apart at this cost.
+    static const int faces[6][4] = {{0, 1, 3, 2}, {4, 5, 7, 6}, {0, 1, 5, 4}, {2, 3, 7, 6}, {0, 2, 6, 4}, {1, 3, 7, 5}};
+    for (const auto& face : faces)
     {
-        Triangle newtri = *t;
-
-        std::array<Eigen::Vector4f, 3> mm {
-                (view * model * t->v[0]),
-                (view * model * t->v[1]),
-                (view * model * t->v[2])
-        };
-
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
-
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-            return v.template head<3>();
-        });
-
-        Eigen::Vector4f v[] = {
-                mvp * t->v[0],
-                mvp * t->v[1],
-                mvp * t->v[2]
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec.x()/=vec.w();
-            vec.y()/=vec.w();
-            vec.z()/=vec.w();
+        for (int half = 0; half < 2; ++half)
+        {
+            const Eigen::Vector4f* v[3] = {&corners[face[0]], &corners[face[half + 1]], &corners[face[half + 2]]};
+            float px[3] = {v[0]->x(), v[1]->x(), v[2]->x()};
+            float py[3] = {v[0]->y(), v[1]->y(), v[2]->y()};
+            float min_x = std::max(0.0f, std::min({px[0], px[1], px[2]}));
+            float max_x = std::min((float)width - 1, std::max({px[0], px[1], px[2]}));
+            float min_y = std::max(0.0f, std::min({py[0], py[1], py[2]}));
+            float max_y = std::min((float)height - 1, std::max({py[0], py[1], py[2]}));
+            if (min_x > max_x || min_y > max_y)
+                continue;
+            int x0 = (int)min_x, x1 = (int)max_x, y0 = (int)min_y, y1 = (int)max_y;
+            edge_setup<float> es;
+            if (!setup_edges(px, py, 1.0f, x0, y0, es))
+                continue;
+
+            // Depth as rasterize_triangle() computes it, from the planes of 1/w and z/w
+            Eigen::Vector3f inv_w(1 / v[0]->w(), 1 / v[1]->w(), 1 / v[2]->w());
+            Eigen::Vector3f z_over_w = Eigen::Vector3f(v[0]->z(), v[1]->z(), v[2]->z()).cwiseProduct(inv_w);
+            float tri_min_z = std::min({v[0]->z(), v[1]->z(), v[2]->z()});
+            bool passed = false;
+            traverse_edges(es, x0, x1, y0, y1, hiz_block,
+                           [&](int bx, int by) { return !passed && tri_min_z < hiz_buf[by * hiz_width + bx]; },
+                           [&](int x, int y, float alpha, float beta, float gamma) {
+                               Eigen::Vector3f bary(alpha, beta, gamma);
+                               passed = passed || depth_buf.nearer(get_index(x, y), z_over_w.dot(bary) / inv_w.dot(bary));
+                           },
+                           [](int, int) {});
+            if (passed)
+                return false;
         }
+    }
+    return true;
+}
 
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-                inv_trans * to_vec4(t->normal[0], 0.0f),
-                inv_trans * to_vec4(t->normal[1], 0.0f),
-                inv_trans * to_vec4(t->normal[2], 0.0f)
-        };
+void rst::rasterizer::draw_depth(pos_buf_id pos_buffer, ind_buf_id ind_buffer)
+{
+    process_vertices(pos_buffer, ind_buffer, col_buf_id{-1}, Primitive::Triangle);
+    bin_triangles();
+    rasterize_tiles(depth_only{});
+}
 
-        //Viewport transformation
-        for (auto & vert : v)
+ShadowMap rst::rasterizer::shadow_map(const Eigen::Matrix4f& lookup_to_world) const
+{
+    std::vector<float> depths((size_t)width * height);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+            depths[(size_t)y * width + x] = depth_buf.get(get_index(x, y));
+
+    Eigen::Matrix4f lookup_to_light = view * lookup_to_world;
+    Eigen::Vector3f light_pos = lookup_to_light.inverse().col(3).hnormalized();
+    return ShadowMap(width, height, std::move(depths), viewport() * projection * lookup_to_light, light_pos);
+}
+
+Eigen::Matrix4f rst::rasterizer::viewport() const
+{
+    Eigen::Matrix4f m;
+    m << 0.5f * width, 0, 0, 0.5f * width,
+         0, 0.5f * height, 0, 0.5f * height,
+         0, 0, depth_scale, depth_offset,
+         0, 0, 0, 1;
+    return m;
+}
+
+void rst::rasterizer::process_vertices(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
+{
+    if (type != rst::Primitive::Triangle)
+    {
+        throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
+    }
+    // Per-draw constants
+    Eigen::Matrix4f mv = view * model;
+    Eigen::Matrix3f normal_matrix = mv.topLeftCorner<3, 3>().inverse().transpose();
+
+    const auto& buf = pos_buf[pos_buffer.pos_id];
+    const Eigen::Vector4f& bounds = pos_bounds[pos_buffer.pos_id];
+    int num_verts = (int)buf.size();
+    int ind_id = ind_buffer.ind_id;
+    auto lod = lods.find(ind_id);
+    if (lod != lods.end())
+    {
+        const lod_entry& level = lod->second[select_lod(bounds, ind_id, mv)];
+        ind_id = level.ind_id;
+        num_verts = level.vertex_count;
+    }
+    const auto& ind = ind_buf[ind_id];
+    // draw_depth() passes no color buffer and needs no attributes at all
+    bool attributes = col_buffer.col_id >= 0;
+    const std::vector<Eigen::Vector3f>* col = attributes ? &col_buf[col_buffer.col_id] : nullptr;
+    const std::vector<Eigen::Vector3f>* nor = attributes && normal_id >= 0 ? &nor_buf[normal_id] : nullptr;
+    const std::vector<Eigen::Vector2f>* tex = attributes && texcoord_id >= 0 ? &tex_buf[texcoord_id] : nullptr;
+
+    int num_tris = (int)ind.size();
+    stats.submitted += num_tris;
+    if (frustum_culling && sphere_outside_frustum(bounds, mv))
+    {
+        stats.frustum += num_tris;
+        screen_tris.clear();
+        screen_view_pos.clear();
+        return;
+    }
+
+    // Vertex stage: every unique vertex is transformed exactly once, a batch of columns at a time.
+    // Primitive assembly below then reads the transformed vertices by index, so these arrays act as
+    // the post-transform cache for the whole draw call.
+    auto stage_start = profile_clock::now();
+    Eigen::Matrix4Xf view_verts(4, num_verts);
+    Eigen::Matrix4Xf clip_verts(4, num_verts);
+    Eigen::Matrix4Xf screen_verts(4, num_verts);
+    Eigen::Matrix3Xf view_normals = Eigen::Matrix3Xf::Zero(3, num_verts);
+    std::vector<int> outcodes(num_verts);
+
+    int num_batches = (num_verts + vertex_batch - 1) / vertex_batch;
+    parallel_for(num_batches, num_threads, [&](int batch) {
+        int begin = batch * vertex_batch;
+        int count = std::min(vertex_batch, num_verts - begin);
+
+        Eigen::Map<const Eigen::Matrix3Xf> positions(buf[begin].data(), 3, count);
+        auto view_batch = view_verts.middleCols(begin, count);
+        auto clip_batch = clip_verts.middleCols(begin, count);
+        view_batch.noalias() = mv * positions.colwise().homogeneous();
+        clip_batch.noalias() = projection * view_batch;
+        if (nor)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            Eigen::Map<const Eigen::Matrix3Xf> normals((*nor)[begin].data(), 3, count);
+            view_normals.middleCols(begin, count).noalias() = normal_matrix * normals;
         }
 
-        for (int i = 0; i < 3; ++i)
+        //Homogeneous division and viewport transformation. Triangles that turn out to need
+        //clipping are redone from clip_verts during assembly.
+        for (int i = 0; i < count; ++i)
         {
-            //screen space coordinates
-            newtri.setVertex(i, v[i]);
+            outcodes[begin + i] = clip_outcode(clip_batch.col(i));
+            screen_verts.col(begin + i) = to_screen(clip_batch.col(i));
         }
+    });
+    if (profiling)
+    {
+        stage_times.vertex += nanoseconds_since(stage_start) * 1e-9;
+        stage_start = profile_clock::now();
+    }
 
-        for (int i = 0; i < 3; ++i)
+    // Primitive assembly, with clipping. Each chunk of triangles is assembled into its own list and
+    // the lists are joined in order, since clipping may drop a triangle or split it into several.
+    chunk_tris.resize(num_threads);
+    chunk_view_pos.resize(num_threads);
+    chunk_stats.assign(num_threads, {});
+    parallel_for(num_threads, num_threads, [&](int chunk) {
+        int begin = (int)((int64_t)num_tris * chunk / num_threads);
+        int end = (int)((int64_t)num_tris * (chunk + 1) / num_threads);
+        auto& tris = chunk_tris[chunk];
+        auto& tris_view_pos = chunk_view_pos[chunk];
+        tris.clear();
+        tris_view_pos.clear();
+        for (int id = begin; id < end; ++id)
         {
-            //view space normal
-            newtri.setNormal(i, n[i].head<3>());
+            const Eigen::Vector3i& tri = ind[id];
+            int codes[3] = {outcodes[tri[0]], outcodes[tri[1]], outcodes[tri[2]]};
+            // Entirely outside one side of the view frustum
+            if (codes[0] & codes[1] & codes[2])
+            {
+                chunk_stats[chunk].frustum++;
+                continue;
+            }
+            if (face_culling != Cull::None && face_culled(clip_verts.col(tri[0]), clip_verts.col(tri[1]), clip_verts.col(tri[2])))
+            {
+                chunk_stats[chunk].back_face++;
+                continue;
+            }
+
+            Triangle t;
+            std::array<Eigen::Vector3f, 3> view_pos;
+            bool clip = (codes[0] | codes[1] | codes[2]) & clip_planes;
+            for (int j = 0; j < 3; ++j)
+            {
+                int vi = tri[j];
+                t.setVertex(j, clip ? clip_verts.col(vi) : screen_verts.col(vi));
+                t.setNormal(j, view_normals.col(vi));
+                if (tex)
+                    t.setTexCoord(j, (*tex)[vi]);
+                if (col)
+                    t.setColor(j, (*col)[vi][0], (*col)[vi][1], (*col)[vi][2]);
+                view_pos[j] = view_verts.col(vi).head<3>();
+            }
+            if (clip)
+            {
+                clip_triangle(t, view_pos, codes[0] | codes[1] | codes[2], tris, tris_view_pos);
+                continue;
+            }
+            tris.push_back(t);
+            tris_view_pos.push_back(view_pos);
         }
+    });
+    join_chunks();
+    if (profiling)
+        stage_times.setup += nanoseconds_since(stage_start) * 1e-9;
+}
+
+void rst::rasterizer::process_vertices(const std::vector<Triangle *> &TriangleList)
+{
+    // Per-draw constants
+    Eigen::Matrix4f mv = view * model;
+    Eigen::Matrix4f mvp = projection * mv;
+    Eigen::Matrix4f inv_trans = mv.inverse().transpose();
+
+    int num_tris = (int)TriangleList.size();
+    stats.submitted += num_tris;
+    chunk_tris.resize(num_threads);
+    chunk_view_pos.resize(num_threads);
+    chunk_stats.assign(num_threads, {});
+    auto stage_start = profile_clock::now();
+
+    // Vertex processing, one contiguous chunk of the triangle list per thread
+    parallel_for(num_threads, num_threads, [&](int chunk) {
+        int begin = (int)((int64_t)num_tris * chunk / num_threads);
+        int end = (int)((int64_t)num_tris * (chunk + 1) / num_threads);
+        auto& tris = chunk_tris[chunk];
+        auto& tris_view_pos = chunk_view_pos[chunk];
+        tris.clear();
+        tris_view_pos.clear();
+        for (int id = begin; id < end; ++id)
+        {
+            const Triangle* t = TriangleList[id];
+            Triangle newtri = *t;
+
+            std::array<Eigen::Vector4f, 3> mm {
+                    (mv * t->v[0]),
+                    (mv * t->v[1]),
+                    (mv * t->v[2])
+            };
+
+            std::array<Eigen::Vector3f, 3> viewspace_pos;
+
+            std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
+                return v.template head<3>();
+            });
+
+            Eigen::Vector4f v[] = {
+                    mvp * t->v[0],
+                    mvp * t->v[1],
+                    mvp * t->v[2]
+            };
+            int codes[3] = {clip_outcode(v[0]), clip_outcode(v[1]), clip_outcode(v[2])};
+            if (codes[0] & codes[1] & codes[2])
+            {
+                chunk_stats[chunk].frustum++;
+                continue;
+            }
+            if (face_culling != Cull::None && face_culled(v[0], v[1], v[2]))
+            {
+                chunk_stats[chunk].back_face++;
+                continue;
+            }
+            bool clip = (codes[0] | codes[1] | codes[2]) & clip_planes;
 
-        newtri.setColor(0, 148,121.0,92.0);
-        newtri.setColor(1, 148,121.0,92.0);
-        newtri.setColor(2, 148,121.0,92.0);
+            Eigen::Vector4f n[] = {
+                    inv_trans * to_vec4(t->normal[0], 0.0f),
+                    inv_trans * to_vec4(t->normal[1], 0.0f),
+                    inv_trans * to_vec4(t->normal[2], 0.0f)
+            };
 
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
+            for (int i = 0; i < 3; ++i)
+            {
+                //screen space coordinates, or clip space if the triangle still has to be clipped
+                newtri.setVertex(i, clip ? v[i] : to_screen(v[i]));
+            }
+
+            for (int i = 0; i < 3; ++i)
+            {
+                //view space normal
+                newtri.setNormal(i, n[i].head<3>());
+            }
+
+            newtri.setColor(0, 148,121.0,92.0);
+            newtri.setColor(1, 148,121.0,92.0);
+            newtri.setColor(2, 148,121.0,92.0);
+
+            // Also keep view space vertice position
+            if (clip)
+            {
+                clip_triangle(newtri, viewspace_pos, codes[0] | codes[1] | codes[2], tris, tris_view_pos);
+                continue;
+            }
+            tris.push_back(newtri);
+            tris_view_pos.push_back(viewspace_pos);
+        }
+    });
+    if (profiling)
+    {
+        stage_times.vertex += nanoseconds_since(stage_start) * 1e-9;
+        stage_start = profile_clock::now();
+    }
+    join_chunks();
+    if (profiling)
+        stage_times.setup += nanoseconds_since(stage_start) * 1e-9;
+}
+
+// Concatenates the per-chunk output of primitive assembly into screen_tris / screen_view_pos, and
+// adds up the per-chunk culling counts
+void rst::rasterizer::join_chunks()
+{
+    screen_tris.clear();
+    screen_view_pos.clear();
+    for (int chunk = 0; chunk < (int)chunk_tris.size(); ++chunk)
+    {
+        screen_tris.insert(screen_tris.end(), chunk_tris[chunk].begin(), chunk_tris[chunk].end());
+        screen_view_pos.insert(screen_view_pos.end(), chunk_view_pos[chunk].begin(), chunk_view_pos[chunk].end());
+        stats.frustum += chunk_stats[chunk].frustum;
+        stats.back_face += chunk_stats[chunk].back_face;
+    }
+}
+
+// True if a bounding sphere (center, radius), in model space, lies entirely outside the near plane
+// or one side of the view frustum. The planes are rows of the projection combined as in
+// clip_outcode(), so they live in view space, where the sphere is moved to with its radius scaled
+// by the largest scale factor of mv.
+bool rst::rasterizer::sphere_outside_frustum(const Eigen::Vector4f& sphere, const Eigen::Matrix4f& mv) const
+{
+    Eigen::Vector4f center = mv * to_vec4(sphere.head<3>(), 1.0f);
+    float radius = sphere.w() * mv.topLeftCorner<3, 3>().colwise().norm().maxCoeff();
+
+    Eigen::Vector4f w = w_sign * projection.row(3).transpose();
+    Eigen::Vector4f x = projection.row(0).transpose();
+    Eigen::Vector4f y = projection.row(1).transpose();
+    const Eigen::Vector4f planes[5] = {w - Eigen::Vector4f(0, 0, 0, near_plane), w + x, w - x, w + y, w - y};
+    for (const auto& plane : planes)
+    {
+        if (plane.dot(center) < -radius * plane.head<3>().norm())
+            return true;
+    }
+    return false;
+}
+
+// Level of ind_id's chain to draw: the coarsest one whose error, scaled by mv and projected at the
+// distance of the sphere's nearest point, is at most lod_threshold pixels. The full mesh is drawn
+// when the camera is inside the sphere.
+int rst::rasterizer::select_lod(const Eigen::Vector4f& sphere, int ind_id, const Eigen::Matrix4f& mv) const
+{
+    const auto& chain = lods.at(ind_id);
+    float scale = mv.topLeftCorner<3, 3>().colwise().norm().maxCoeff();
+    float distance = (mv * to_vec4(sphere.head<3>(), 1.0f)).head<3>().norm() - sphere.w() * scale;
+    if (lod_threshold <= 0 || distance <= near_plane)
+        return 0;
+    // Pixels per model unit at that distance
+    float pixels = scale * std::abs(projection(1, 1)) * 0.5f * height / distance;
+    int level = 0;
+    while (level + 1 < (int)chain.size() && chain[level + 1].error * pixels <= lod_threshold)
+        level++;
+    return level;
+}
+
+// Face culling of a triangle given in clip space. With w' = w_sign * w, the determinant of the rows
+// (x, y, w') is the screen-space signed area times w'0 * w'1 * w'2, so it is positive for a
+// counter-clockwise triangle in front of the camera. It is also the signed volume spanned by the
+// eye and the triangle, which keeps it meaningful for triangles crossing the near plane.
+bool rst::rasterizer::face_culled(const Eigen::Vector4f& v0, const Eigen::Vector4f& v1, const Eigen::Vector4f& v2) const
+{
+    Eigen::Matrix3f m;
+    m << v0.x(), v0.y(), w_sign * v0.w(),
+         v1.x(), v1.y(), w_sign * v1.w(),
+         v2.x(), v2.y(), w_sign * v2.w();
+    float facing = m.determinant();
+    if (facing == 0)
+        return true;
+    return face_culling == Cull::Back ? facing < 0 : facing > 0;
+}
+
+// One bit per plane of the view frustum or of the guard band that v (in clip space) lies outside of.
+// w_sign * w is the distance in front of the camera, so the frustum is |x|, |y| <= w_sign * w.
+int rst::rasterizer::clip_outcode(const Eigen::Vector4f& v) const
+{
+    float w = w_sign * v.w();
+    float g = guard_band * w;
+    int code = w < near_plane ? outside_near : 0;
+    code |= (v.x() < -g ? outside_guard_band[0] : 0) | (v.x() > g ? outside_guard_band[1] : 0);
+    code |= (v.y() < -g ? outside_guard_band[2] : 0) | (v.y() > g ? outside_guard_band[3] : 0);
+    code |= (v.x() < -w ? outside_frustum[0] : 0) | (v.x() > w ? outside_frustum[1] : 0);
+    code |= (v.y() < -w ? outside_frustum[2] : 0) | (v.y() > w ? outside_frustum[3] : 0);
+    return code;
+}
+
+//Homogeneous division and viewport transformation
+Eigen::Vector4f rst::rasterizer::to_screen(const Eigen::Vector4f& v) const
+{
+    float f1 = depth_scale;
+    float f2 = depth_offset;
+
+    float w = v.w();
+    Eigen::Vector4f vert;
+    vert.x() = 0.5*width*(v.x()/w+1.0);
+    vert.y() = 0.5*height*(v.y()/w+1.0);
+    vert.z() = v.z()/w * f1 + f2;
+    vert.w() = w;
+    return vert;
+}
+
+// Sutherland-Hodgman clipping of t, given in clip space, against the near plane and those sides of
+// the guard band that codes has bits for. Attributes are linear along an edge in clip space, so the
+// new vertices interpolate them with the same parameter as their position. The convex result is
+// fanned into screen-space triangles appended to tris / tris_view_pos.
+void rst::rasterizer::clip_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos, int codes,
+                                    std::vector<Triangle>& tris, std::vector<std::array<Eigen::Vector3f, 3>>& tris_view_pos) const
+{
+    struct clip_vertex
+    {
+        Eigen::Vector4f pos;
+        Eigen::Vector3f color, normal, view_pos;
+        Eigen::Vector2f tex_coords;
+    };
+
+    // Signed distance to a clipping plane, positive inside. Plane 0 is the near plane, 1..4 the
+    // sides of the guard band in the order of outside_guard_band.
+    auto distance = [&](const Eigen::Vector4f& v, int plane) {
+        float w = w_sign * v.w();
+        switch (plane)
+        {
+            case 0: return w - near_plane;
+            case 1: return guard_band * w + v.x();
+            case 2: return guard_band * w - v.x();
+            case 3: return guard_band * w + v.y();
+            default: return guard_band * w - v.y();
+        }
+    };
+    const int plane_bits[5] = {outside_near, outside_guard_band[0], outside_guard_band[1], outside_guard_band[2], outside_guard_band[3]};
+
+    // Every plane adds at most one vertex
+    clip_vertex buf[2][8];
+    clip_vertex* in = buf[0];
+    clip_vertex* out = buf[1];
+    int count = 3;
+    for (int i = 0; i < 3; ++i)
+        in[i] = {t.v[i], t.color[i], t.normal[i], view_pos[i], t.tex_coords[i]};
+
+    for (int plane = 0; plane < 5 && count >= 3; ++plane)
+    {
+        if (!(codes & plane_bits[plane]))
+            continue;
+        int out_count = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            const clip_vertex& a = in[i];
+            const clip_vertex& b = in[(i + 1) % count];
+            float da = distance(a.pos, plane), db = distance(b.pos, plane);
+            if (da >= 0)
+                out[out_count++] = a;
+            if ((da >= 0) != (db >= 0))
+            {
+                float s = da / (da - db);
+                out[out_count++] = {a.pos + s * (b.pos - a.pos), a.color + s * (b.color - a.color),
+                                    a.normal + s * (b.normal - a.normal), a.view_pos + s * (b.view_pos - a.view_pos),
+                                    a.tex_coords + s * (b.tex_coords - a.tex_coords)};
+            }
+        }
+        std::swap(in, out);
+        count = out_count;
+    }
+
+    for (int i = 1; i + 1 < count; ++i)
+    {
+        Triangle clipped = t;
+        std::array<Eigen::Vector3f, 3> clipped_view_pos;
+        const clip_vertex* fan[3] = {&in[0], &in[i], &in[i + 1]};
+        for (int j = 0; j < 3; ++j)
+        {
+            clipped.v[j] = to_screen(fan[j]->pos);
+            clipped.color[j] = fan[j]->color;
+            clipped.normal[j] = fan[j]->normal;
+            clipped.tex_coords[j] = fan[j]->tex_coords;
+            clipped_view_pos[j] = fan[j]->view_pos;
+        }
+        tris.push_back(clipped);
+        tris_view_pos.push_back(clipped_view_pos);
+    }
+}
+
+// Sets up the plane equations of screen_tris and bins them into tiles. Each thread takes one
+// contiguous chunk of the triangles and bins it into its own per-tile lists, so that walking the
+// chunks in order visits a tile's triangles in submission order.
+void rst::rasterizer::bin_triangles()
+{
+    auto stage_start = profile_clock::now();
+    int num_tris = (int)screen_tris.size();
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+    screen_setup.resize(num_tris);
+
+    bins.resize(num_threads);
+    for (auto& chunk_bins : bins)
+    {
+        chunk_bins.resize(tiles_x * tiles_y);
+        for (auto& tile_bin : chunk_bins)
+            tile_bin.clear();
     }
+    parallel_for(num_threads, num_threads, [&](int chunk) {
+        int begin = (int)((int64_t)num_tris * chunk / num_threads);
+        int end = (int)((int64_t)num_tris * (chunk + 1) / num_threads);
+        for (int id = begin; id < end; ++id)
+        {
+            rect bbox;
+            if (!screen_bounds(screen_tris[id], bbox))
+                continue;
+
+            // The screen-space barycentrics change by ((y1 - y2), (y2 - y0), (y0 - y1)) / area per
+            // pixel in x and by ((x2 - x1), (x0 - x2), (x1 - x0)) / area in y
+            const Triangle& t = screen_tris[id];
+            const Eigen::Vector4f& v0 = t.v[0];
+            const Eigen::Vector4f& v1 = t.v[1];
+            const Eigen::Vector4f& v2 = t.v[2];
+            triangle_setup& setup = screen_setup[id];
+            setup.inv_w = Eigen::Vector3f(1 / v0.w(), 1 / v1.w(), 1 / v2.w());
+            setup.z_over_w = Eigen::Vector3f(v0.z(), v1.z(), v2.z()).cwiseProduct(setup.inv_w);
+            float area = (v1.x() - v0.x()) * (v2.y() - v0.y()) - (v1.y() - v0.y()) * (v2.x() - v0.x());
+            Eigen::Vector3f ddx = Eigen::Vector3f(v1.y() - v2.y(), v2.y() - v0.y(), v0.y() - v1.y()) / area;
+            Eigen::Vector3f ddy = Eigen::Vector3f(v2.x() - v1.x(), v0.x() - v2.x(), v1.x() - v0.x()) / area;
+            setup.dh_dx = ddx.cwiseProduct(setup.inv_w);
+            setup.dh_dy = ddy.cwiseProduct(setup.inv_w);
+
+            for (int ty = bbox.y0 / tile_size; ty <= bbox.y1 / tile_size; ++ty)
+                for (int tx = bbox.x0 / tile_size; tx <= bbox.x1 / tile_size; ++tx)
+                    bins[chunk][ty * tiles_x + tx].push_back(id);
+        }
+    });
+    if (profiling)
+        stage_times.setup += nanoseconds_since(stage_start) * 1e-9;
+}
+
+// Pixel bounding box of a screen-space triangle clamped to the screen; false if it is off-screen.
+bool rst::rasterizer::screen_bounds(const Triangle& t, rect& bbox) const
+{
+    float min_x = std::min({t.v[0].x(), t.v[1].x(), t.v[2].x()});
+    float max_x = std::max({t.v[0].x(), t.v[1].x(), t.v[2].x()});
+    float min_y = std::min({t.v[0].y(), t.v[1].y(), t.v[2].y()});
+    float max_y = std::max({t.v[0].y(), t.v[1].y(), t.v[2].y()});
+    if (!(max_x >= 0 && min_x < width && max_y >= 0 && min_y < height))
+        return false;
+
+    bbox.x0 = (int)std::max(0.0f, min_x);
+    bbox.x1 = (int)std::min((float)width - 1, max_x);
+    bbox.y0 = (int)std::max(0.0f, min_y);
+    bbox.y1 = (int)std::min((float)height - 1, max_y);
+    return true;
+}
+
+// Recomputes the max depth of Hi-Z block (bx, by) after depth writes. Keeping the old value would
+// still be conservative, since writes only ever bring depths closer.
+void rst::rasterizer::update_hiz(int bx, int by)
+{
+    int x0 = bx * hiz_block, x1 = std::min(x0 + hiz_block, width);
+    int y0 = by * hiz_block, y1 = std::min(y0 + hiz_block, height);
+    float max_z = -std::numeric_limits<float>::infinity();
+    for (int y = y0; y < y1; ++y)
+        max_z = std::max(max_z, depth_buf.max(get_index(x0, y), x1 - x0));
+    hiz_buf[by * hiz_width + bx] = max_z;
 }
 
-static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
-{
-    return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
-}
-
-static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
-{
-    auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
-    auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
-
-    u /= weight;
-    v /= weight;
-
-    return Eigen::Vector2f(u, v);
-}
-
-//Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos) 
-{
-    // TODO: From your HW3, get the triangle rasterization code.
-    // TODO: Inside your rasterization loop:
-    //    * v[i].w() is the vertex view space depth value z.
-    //    * Z is interpolated view space depth for the current pixel
-    //    * zp is depth between zNear and zFar, used for z-buffer
-    
-    // 获取三角形顶点
-    const auto& v0 = t.v[0];
-    const auto& v1 = t.v[1];
-    const auto& v2 = t.v[2];
-    // 计算包围盒
-    float min_x = std::min({v0.x(), v1.x(), v2.x()});
-    float max_x = std::max({v0.x(), v1.x(), v2.x()});
-    float min_y = std::min({v0.y(), v1.y(), v2.y()});
-    float max_y = std::max({v0.y(), v1.y(), v2.y()});
-    // // 限制在屏幕范围内
-    // min_x = std::max(0.0f, std::floor(min_x));
-    // max_x = std::min((float)width - 1, std::ceil(max_x));
-    // min_y = std::max(0.0f, std::floor(min_y));
-    // max_y = std::min((float)height - 1, std::ceil(max_y));
-    Vector4f tri[3] = {v0, v1, v2};
-
-    
-    // float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-    // float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-    // zp *= Z;
-
-    // TODO: Interpolate the attributes:
-    // auto interpolated_color
-    // auto interpolated_normal
-    // auto interpolated_texcoords
-    // auto interpolated_shadingcoords
-
-    // Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-    // Use: payload.view_pos = interpolated_shadingcoords;
-    // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
-    // Use: auto pixel_color = fragment_shader(payload);
-    // 遍历包围盒内所有像素
-    for (int x = (int)min_x; x <= (int)max_x; ++x) {
-        for (int y = (int)min_y; y <= (int)max_y; ++y) {
-            float px = x + 0.5f;
-            float py = y + 0.5f;
-            if (!insideTriangle(px, py, tri)) continue;
-            // 计算重心坐标
-            auto [alpha, beta, gamma] = computeBarycentric2D(px, py, tri);
-            // 透视矫正插值
-            float w_reciprocal = 1.0f / (alpha / v0.w() + beta / v1.w() + gamma / v2.w());
-            float z_interpolated = alpha * v0.z() / v0.w() + beta * v1.z() / v1.w() + gamma * v2.z() / v2.w();
-            z_interpolated *= w_reciprocal;
-
-            // 转化成一维索引
-            int buf_index = get_index(x, y);
-            //颜色深度插值
-            if (z_interpolated < depth_buf[buf_index]) {
-                // // 插值属性
-                // auto interpolated_color = interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2], w_reciprocal);
-                // auto interpolated_normal = interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2], w_reciprocal);
-                // auto interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], w_reciprocal);
-                // auto interpolated_shadingcoords = interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2], w_reciprocal);
-                auto interpolated_color = alpha*t.color[0]+ beta*t.color[1]+gamma*t.color[2];
-                auto interpolated_normal = alpha*t.normal[0]+ beta*t.normal[1]+gamma*t.normal[2];
-                auto interpolated_texcoords = alpha*t.tex_coords[0]+ beta*t.tex_coords[1]+gamma*t.tex_coords[2];
-                auto interpolated_shadingcoords = alpha*view_pos[0]+ beta*view_pos[1]+gamma*view_pos[2];
-
-                // 构造payload
-                fragment_shader_payload payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-                payload.view_pos = interpolated_shadingcoords;
-                // 着色
-                Eigen::Vector3f pixel_color = fragment_shader(payload);
-                set_pixel(Eigen::Vector2i(x, y), pixel_color);
-                depth_buf[buf_index] = z_interpolated;
+// Builds the light list of every light tile in tile. The pixels the visibility buffer has covered
+// there lie between their nearest and farthest depth, which bounds them by a slice of the tile's
+// frustum; a light is listed if its sphere of influence reaches the view-space bounding box of the
+// slice's corners. Tiles without covered pixels get an empty list.
+void rst::rasterizer::cull_lights(const rect& tile)
+{
+    for (int ty = tile.y0; ty <= tile.y1; ty += light_tile)
+    {
+        for (int tx = tile.x0; tx <= tile.x1; tx += light_tile)
+        {
+            int x1 = std::min(tx + light_tile - 1, tile.x1), y1 = std::min(ty + light_tile - 1, tile.y1);
+            float z0 = std::numeric_limits<float>::infinity(), z1 = -z0;
+            for (int y = ty; y <= y1; ++y)
+            {
+                for (int x = tx; x <= x1; ++x)
+                {
+                    int buf_index = get_index(x, y);
+                    if (vis_id[buf_index] < 0)
+                        continue;
+                    float z = depth_buf.get(buf_index);
+                    z0 = std::min(z0, z);
+                    z1 = std::max(z1, z);
+                }
+            }
+
+            auto& list = tile_lights[(ty / light_tile) * light_tiles_x + tx / light_tile];
+            list.clear();
+            if (z0 > z1)
+                continue;
+
+            Eigen::Vector3f lo = Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity()), hi = -lo;
+            for (int corner = 0; corner < 8; ++corner)
+            {
+                Eigen::Vector4f screen(corner & 1 ? x1 + 1 : tx, corner & 2 ? y1 + 1 : ty, corner & 4 ? z1 : z0, 1);
+                Eigen::Vector3f p = (screen_to_view * screen).hnormalized();
+                lo = lo.cwiseMin(p);
+                hi = hi.cwiseMax(p);
+            }
+            for (size_t i = 0; i < lights.size(); ++i)
+            {
+                const light& l = lights[i];
+                Eigen::Vector3f nearest = l.position.cwiseMax(lo).cwiseMin(hi);
+                if ((nearest - l.position).squaredNorm() <= l.radius * l.radius)
+                    list.push_back((int)i);
             }
         }
     }
@@ -348,38 +879,88 @@ void rst::rasterizer::set_view(const Eigen::Matrix4f& v)
 void rst::rasterizer::set_projection(const Eigen::Matrix4f& p)
 {
     projection = p;
+    // View space looks down -z, so w = projection(3, 2) * z is negative in front of the camera
+    // for a projection with projection(3, 2) > 0, such as the one of this assignment
+    w_sign = projection(3, 2) > 0 ? -1.0f : 1.0f;
+}
+
+// Splits the wall time of a tile pass between its stages in proportion to their thread time
+void rst::rasterizer::add_tile_profiles(bool deferred, int64_t wall)
+{
+    int64_t raster = 0, shading = 0, resolve = 0;
+    for (const auto& tile : tile_profiles)
+    {
+        raster += tile.raster;
+        shading += tile.shading;
+        resolve += tile.resolve;
+        stage_times.fragments_shaded += tile.fragments;
+    }
+    // Shading happens inside resolve_tile() in deferred mode and inside the raster part otherwise
+    if (deferred)
+        resolve -= shading;
+    else
+        raster -= shading;
+    double total = (double)std::max<int64_t>(1, raster + shading + resolve);
+    double scale = wall * 1e-9 / total;
+    stage_times.raster += std::max<int64_t>(0, raster) * scale;
+    stage_times.shading += shading * scale;
+    stage_times.resolve += std::max<int64_t>(0, resolve) * scale;
+}
+
+rst::stage_stats rst::rasterizer::profile() const
+{
+    stage_stats out = stage_times;
+    for (size_t i = 0; i < depth_buf.size(); ++i)
+        out.pixels_covered += depth_buf.get(i) != std::numeric_limits<float>::infinity();
+    return out;
 }
 
 void rst::rasterizer::clear(rst::Buffers buff)
 {
+    stats = {};
+    stage_times = {};
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        frame_buf.fill(Eigen::Vector3f{0, 0, 0});
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
-        std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        depth_buf.fill(0, depth_buf.size(), std::numeric_limits<float>::infinity());
+        std::fill(hiz_buf.begin(), hiz_buf.end(), std::numeric_limits<float>::infinity());
     }
 }
 
-rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
+rst::rasterizer::rasterizer(int w, int h) : frame_buf(w, h), width(w), height(h)
 {
-    frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
+    depth_buf.reset(w * h, DepthFormat::Float);
+
+    hiz_width = (w + hiz_block - 1) / hiz_block;
+    hiz_buf.assign(hiz_width * ((h + hiz_block - 1) / hiz_block), std::numeric_limits<float>::infinity());
+
+    light_tiles_x = (w + light_tile - 1) / light_tile;
+    tile_lights.resize(light_tiles_x * ((h + light_tile - 1) / light_tile));
 
     texture = std::nullopt;
-}
 
-int rst::rasterizer::get_index(int x, int y)
-{
-    return (height-y)*width + x;
+    num_threads = std::max(1, (int)std::thread::hardware_concurrency());
 }
 
 void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
 {
     //old index: auto ind = point.y() + point.x() * width;
-    int ind = (height-point.y())*width + point.x();
-    frame_buf[ind] = color;
+    int ind = (height-1-point.y())*width + point.x();
+    frame_buf.set(ind, color);
+}
+
+void rst::rasterizer::set_color_format(ColorFormat format)
+{
+    frame_buf = color_buffer(width, height, format);
+}
+
+void rst::rasterizer::set_depth_format(DepthFormat format)
+{
+    depth_buf.reset(width * height, format);
+    std::fill(hiz_buf.begin(), hiz_buf.end(), std::numeric_limits<float>::infinity());
 }
 
 void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader)
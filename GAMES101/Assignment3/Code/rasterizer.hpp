@@ -7,7 +7,20 @@
 #include <eigen3/Eigen/Eigen>
 #include <optional>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "bezier_patch.hpp"
+#include "framebuffer.hpp"
 #include "global.hpp"
+#include "mesh_lod.hpp"
 #include "Shader.hpp"
 #include "Triangle.hpp"
 
@@ -37,6 +50,43 @@ namespace rst
         Triangle
     };
 
+    enum class Shading
+    {
+        Forward,  // shade every fragment that passes the depth test
+        Deferred  // depth + visibility pass first, then shade each visible pixel once
+    };
+
+    enum class Cull
+    {
+        None,
+        Back,  // triangles wound clockwise on screen (with y up)
+        Front  // triangles wound counter-clockwise on screen
+    };
+
+    // Triangles submitted to and rejected by draw() since the last clear()
+    struct cull_stats
+    {
+        int submitted = 0;
+        int frustum = 0;    // outside the view frustum, whole meshes by their bounding sphere or one by one
+        int back_face = 0;  // removed by face culling, including degenerate triangles
+        int occluded = 0;   // in meshes that draw_objects() skipped after an occlusion query
+    };
+
+    // Where draw() spent its time since the last clear(), gathered while profiling is on. Times are
+    // wall-clock seconds. Raster, shading and resolve all happen in the tile pass; its time is split
+    // between them in proportion to the thread time each took. In the draw() taking a triangle list,
+    // vertex also covers primitive assembly, which is done in the same loop.
+    struct stage_stats
+    {
+        double vertex = 0;   // vertex transforms
+        double setup = 0;    // primitive assembly, clipping, face culling and binning
+        double raster = 0;   // edge and depth tests, visibility buffer writes
+        double shading = 0;  // attribute interpolation and fragment shader calls
+        double resolve = 0;  // the rest of deferred shading: visibility buffer walk, light culling
+        int64_t fragments_shaded = 0;  // shader invocations, four lanes per call of a quad shader
+        int64_t pixels_covered = 0;    // pixels whose depth is no longer at infinity
+    };
+
     /*
      * For the curious : The draw function takes two buffer id's as its arguments. These two structs
      * make sure that if you mix up with their orders, the compiler won't compile it.
@@ -57,6 +107,23 @@ namespace rst
         int col_id = 0;
     };
 
+    struct tex_buf_id
+    {
+        int tex_id = 0;
+    };
+
+    // One mesh of draw_objects(), placed by model. Normals and texcoords of -1 leave the most
+    // recently loaded buffers in place.
+    struct draw_object
+    {
+        pos_buf_id pos;
+        ind_buf_id ind;
+        col_buf_id col;
+        Eigen::Matrix4f model = Eigen::Matrix4f::Identity();
+        col_buf_id normals{-1};
+        tex_buf_id texcoords{-1};
+    };
+
     class rasterizer
     {
     public:
@@ -65,6 +132,17 @@ namespace rst
         ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
         col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
         col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+        tex_buf_id load_texcoords(const std::vector<Eigen::Vector2f>& texcoords);
+        // Loads every level of a lod_chain into its own index buffer and returns the one of
+        // levels[0]. Indexed draws of it then draw the coarsest level whose error, projected at the
+        // nearest point of the position buffer's bounding sphere, is at most lod_threshold pixels,
+        // and only run the vertex stage on the vertices that level uses.
+        ind_buf_id load_lods(const std::vector<lod_level>& levels);
+        // Tessellates patches for the current model, view, projection and viewport into pieces of at
+        // most edge_pixels on screen, see patch_tessellator, and loads the mesh into position, index,
+        // color, normal and texcoord buffers the rasterizer keeps for patches. Every call replaces
+        // their contents. Returns them as a draw_object placed by the current model.
+        draw_object load_patches(const patch_tessellator& patches, float edge_pixels, const Eigen::Vector3f& color);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
@@ -72,22 +150,169 @@ namespace rst
 
         void set_texture(Texture tex) { texture = tex; }
 
+        // Lights handed to the fragment shaders through their payload, in view space. When shading
+        // goes through the visibility buffer, each light_tile x light_tile screen tile also gets the
+        // list of the lights that can reach the depth range of its pixels.
+        void set_lights(std::vector<light> scene_lights) { lights = std::move(scene_lights); }
+
+        // Shadow maps handed to the fragment shaders through their payload, one per light
+        void set_shadow_maps(std::vector<ShadowMap> maps) { shadow_maps = std::move(maps); }
+
         void set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader);
         void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader);
 
         void set_pixel(const Vector2i &point, const Eigen::Vector3f &color);
 
+        // Sub-pixel precision of the edge functions: 0 evaluates them in floating point, n > 0 snaps
+        // vertices to a 1/2^n pixel grid and evaluates them exactly in fixed point.
+        void set_subpixel_precision(int bits) { subpixel_bits = std::clamp(bits, 0, 16); }
+
+        // Number of worker threads used by draw(); defaults to the hardware concurrency.
+        void set_thread_count(int n) { num_threads = std::max(1, n); }
+
+        void set_shading_mode(Shading mode) { shading = mode; }
+
+        // Distance in front of the camera below which geometry is clipped away
+        void set_near_plane(float distance) { near_plane = distance; }
+
+        // Face culling happens in primitive assembly, before clipping; none by default.
+        void set_face_culling(Cull mode) { face_culling = mode; }
+
+        // Whether the indexed draw() first tests the bounding sphere of the whole position buffer
+        // against the view frustum; on by default. Triangles are always rejected one by one.
+        void set_frustum_culling(bool enable) { frustum_culling = enable; }
+
+        // Whether draw_objects() skips meshes whose bounding box fails an occlusion query; on by
+        // default
+        void set_occlusion_culling(bool enable) { occlusion_culling = enable; }
+
+        // Occlusion query: true if no pixel of the bounding box of pos_buffer, placed by the current
+        // model, view and projection, is nearer than the depth buffer. The box is rasterized
+        // without writing anything. Boxes reaching behind the near plane always count as visible.
+        bool occluded(pos_buf_id pos_buffer) const;
+
+        // Screen-space error, in pixels, allowed to the levels of detail of load_lods(); 1 by
+        // default, 0 always draws the full mesh
+        void set_lod_threshold(float pixels) { lod_threshold = std::max(0.0f, pixels); }
+
+        const cull_stats& culling_stats() const { return stats; }
+
+        // Off by default: timing every fragment costs a few percent in forward shading
+        void set_profiling(bool enable) { profiling = enable; }
+        stage_stats profile() const;
+
+        // Bounding sphere (center, radius) of a position buffer, in model space
+        const Eigen::Vector4f& bounding_sphere(pos_buf_id pos_buffer) const { return pos_bounds.at(pos_buffer.pos_id); }
+
         void clear(Buffers buff);
 
+        // Indexed draw: uses the most recently loaded normal and texcoord buffers, which must be
+        // indexed like pos_buffer. Colors are in [0, 255].
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
         void draw(std::vector<Triangle *> &TriangleList);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // Depth-only draw, e.g. the pass of a shadow map: fills the depth buffer without running a
+        // fragment shader or writing colors, and without processing any vertex attribute
+        void draw_depth(pos_buf_id pos_buffer, ind_buf_id ind_buffer);
+
+        // The depth buffer as the shadow map of a light at the eye of the current view and
+        // projection. It is looked up with positions in the space that lookup_to_world maps to world
+        // space, e.g. with view-space positions given the inverse view matrix of the camera.
+        ShadowMap shadow_map(const Eigen::Matrix4f& lookup_to_world) const;
+
+        // Same as above, but with the fragment shader given as a callable instead of the one set by
+        // set_fragment_shader(). The shader is called directly from the pixel loop, so a function
+        // object, e.g. a plain shader function wrapped in rst::static_shader (defined after this
+        // class), is inlined there instead of going through std::function.
+        // A shader taking a fragment_quad_payload is run once per 2x2 pixel quad; draw() then always
+        // goes through the visibility buffer, whatever the shading mode.
+        template <typename Shader>
+        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type, const Shader& shader);
+        template <typename Shader>
+        void draw(std::vector<Triangle *> &TriangleList, const Shader& shader);
+
+        // Draws several meshes front to back, by the nearest point of their bounding spheres, each
+        // with an occlusion query first unless occlusion culling is off. Leaves the model matrix of
+        // the last mesh drawn; the normal and texcoord buffers of draw() are left as they were.
+        void draw_objects(const std::vector<draw_object>& objects);
+        template <typename Shader>
+        void draw_objects(const std::vector<draw_object>& objects, const Shader& shader);
+
+        // Storage of the color and depth buffers, BGR8 and Float by default. Clears the buffer.
+        void set_color_format(ColorFormat format);
+        void set_depth_format(DepthFormat format);
+
+        color_buffer& frame_buffer() { return frame_buf; }
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
-        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        // Inclusive pixel rectangle
+        struct rect
+        {
+            int x0, y0, x1, y1;
+        };
+
+        bool screen_bounds(const Triangle& t, rect& bbox) const;
+
+        // Recomputes pos_bounds and pos_boxes of a position buffer
+        void update_bounds(int pos_id);
+
+        // Geometry stage of draw(): fills screen_tris and screen_view_pos
+        void process_vertices(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
+        void process_vertices(const std::vector<Triangle *> &TriangleList);
+        void join_chunks();
+        void bin_triangles();
+
+        bool sphere_outside_frustum(const Eigen::Vector4f& sphere, const Eigen::Matrix4f& mv) const;
+        int select_lod(const Eigen::Vector4f& sphere, int ind_id, const Eigen::Matrix4f& mv) const;
+        bool face_culled(const Eigen::Vector4f& v0, const Eigen::Vector4f& v1, const Eigen::Vector4f& v2) const;
+        int clip_outcode(const Eigen::Vector4f& v) const;
+        Eigen::Vector4f to_screen(const Eigen::Vector4f& v) const;
+        // to_screen() as a matrix, applied before the division by w
+        Eigen::Matrix4f viewport() const;
+        void clip_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos, int codes,
+                           std::vector<Triangle>& tris, std::vector<std::array<Eigen::Vector3f, 3>>& tris_view_pos) const;
+
+        template <typename Shader>
+        void rasterize_tiles(const Shader& shader);
+        template <typename Shader>
+        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos, int id, const rect& clip, const Shader& shader);
+        void update_hiz(int bx, int by);
+        void cull_lights(const rect& tile);
+        const std::vector<int>* lights_at(int x, int y) const { return &tile_lights[(y / light_tile) * light_tiles_x + x / light_tile]; }
+        template <typename Shader>
+        void shade_fragment(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos, int x, int y, float alpha, float beta, float gamma,
+                            const std::vector<int>* tile_light_list, const Shader& shader);
+        template <typename Shader>
+        void resolve_tile(const rect& tile, const Shader& shader);
+        template <typename Shader>
+        void shade_quad(int x, int y, const Shader& shader);
+
+        // Thread time of one tile in the tile pass of the current draw, in nanoseconds. Like the
+        // tile's pixels, it is only touched by the thread rasterizing the tile.
+        struct tile_profile
+        {
+            int64_t raster = 0;   // everything but resolve_tile()
+            int64_t shading = 0;  // shade_fragment() and shade_quad(), in either part
+            int64_t resolve = 0;  // resolve_tile(), shading included
+            int64_t fragments = 0;
+        };
+        using profile_clock = std::chrono::steady_clock;
+        static int64_t nanoseconds_since(profile_clock::time_point start)
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(profile_clock::now() - start).count();
+        }
+        tile_profile& profile_at(int x, int y) { return tile_profiles[(y / tile_size) * ((width + tile_size - 1) / tile_size) + x / tile_size]; }
+        void add_tile_profiles(bool deferred, int64_t wall);
+
+        template <typename Shader>
+        static constexpr bool is_quad_shader = std::is_invocable_v<const Shader&, const fragment_quad_payload&>;
+
+        // Stand-in shader of draw_depth()
+        struct depth_only {};
+        template <typename Shader>
+        static constexpr bool is_depth_only = std::is_same_v<Shader, depth_only>;
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -97,24 +322,634 @@ namespace rst
         Eigen::Matrix4f projection;
 
         int normal_id = -1;
+        int texcoord_id = -1;
 
         std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
+        // Bounding sphere (center, radius) and bounding box of each position buffer, in model space
+        std::map<int, Eigen::Vector4f> pos_bounds;
+        std::map<int, Eigen::AlignedBox3f> pos_boxes;
         std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
         std::map<int, std::vector<Eigen::Vector3f>> col_buf;
         std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        std::map<int, std::vector<Eigen::Vector2f>> tex_buf;
+
+        // Levels of detail registered by load_lods(), by the index buffer of their full mesh
+        struct lod_entry
+        {
+            int ind_id;
+            int vertex_count;
+            float error;
+        };
+        std::map<int, std::vector<lod_entry>> lods;
+        float lod_threshold = 1.0f;
+
+        // Buffers of load_patches(), created by its first call, and the mesh holding the storage of
+        // the previous call's buffers
+        struct patch_buffer_ids
+        {
+            int pos = -1, ind = -1, col = -1, nor = -1, tex = -1;
+        };
+        patch_buffer_ids patch_buffers;
+        indexed_mesh patch_mesh;
 
         std::optional<Texture> texture;
+        std::vector<light> lights;
+        std::vector<ShadowMap> shadow_maps;
+
+        // Tiled light culling, redone by every draw call that goes through the visibility buffer:
+        // per light tile, the indices of the lights whose sphere of influence reaches the pixels
+        // the draw covers there. screen_to_view inverts viewport() * projection.
+        static constexpr int light_tile = 16;
+        int light_tiles_x;
+        Eigen::Matrix4f screen_to_view;
+        std::vector<std::vector<int>> tile_lights;
 
         std::function<Eigen::Vector3f(fragment_shader_payload)> fragment_shader;
         std::function<Eigen::Vector3f(vertex_shader_payload)> vertex_shader;
 
-        std::vector<Eigen::Vector3f> frame_buf;
-        std::vector<float> depth_buf;
-        int get_index(int x, int y);
+        color_buffer frame_buf;
+        depth_buffer depth_buf;
+        int get_index(int x, int y) const { return (height - 1 - y) * width + x; }
+
+        // Depth mapping of to_screen(): NDC z to the depth stored in depth_buf
+        static constexpr float depth_scale = (50 - 0.1) / 2.0;
+        static constexpr float depth_offset = (50 + 0.1) / 2.0;
+
+        // Hierarchical Z: farthest depth_buf value of each hiz_block x hiz_block screen block, used to
+        // reject whole blocks of a triangle before any per-pixel edge test
+        static constexpr int hiz_block = 8;
+        int hiz_width;
+        std::vector<float> hiz_buf;
+
+        // Visibility buffer for Shading::Deferred: id of the front-most triangle of the current
+        // draw call (-1 if none) and its barycentric weights at the pixel center
+        Shading shading = Shading::Forward;
+        std::vector<int> vis_id;
+        std::vector<Eigen::Vector3f> vis_bary;
 
         int width, height;
 
+        int subpixel_bits = 0;
+
+        // Clipping: triangles crossing the near plane, or reaching further than guard_band times the
+        // viewport half-size off its center, are clipped in homogeneous space. Everything in
+        // between is left to the bounding-box clamp of the rasterizer. Outcode bits of
+        // clip_outcode(), sides in the order -x, +x, -y, +y:
+        static constexpr float guard_band = 8.0f;
+        static constexpr int outside_near = 1;
+        static constexpr int outside_guard_band[4] = {2, 4, 8, 16};
+        static constexpr int outside_frustum[4] = {32, 64, 128, 256};
+        static constexpr int clip_planes = outside_near | 2 | 4 | 8 | 16;
+        float near_plane = 1e-5f;
+        float w_sign = 1.0f;
+
+        Cull face_culling = Cull::None;
+        bool frustum_culling = true;
+        bool occlusion_culling = true;
+        cull_stats stats;
+
+        bool profiling = false;
+        stage_stats stage_times;
+        std::vector<tile_profile> tile_profiles;
+
+        // draw() bins triangles into tile_size x tile_size screen tiles, each rasterized by one thread
+        static constexpr int tile_size = 64;
+        // Vertices per batched product in the vertex stage of the indexed draw
+        static constexpr int vertex_batch = 1024;
+        int num_threads = 1;
+
+        // Per-draw scratch: screen-space triangles with their view-space positions, and per chunk of
+        // triangles the ids binned to each tile and the output of primitive assembly
+        std::vector<Triangle> screen_tris;
+        std::vector<std::array<Eigen::Vector3f, 3>> screen_view_pos;
+        // Plane equations of each screen triangle, set up by bin_triangles(). With (a, b, c) the
+        // screen-space barycentrics, 1/w = inv_w . (a, b, c) and z/w = z_over_w . (a, b, c); the
+        // perspective-correct barycentrics are (a, b, c) * inv_w / (1/w), and grows by dh_dx per
+        // pixel in x and dh_dy in y before that division.
+        struct triangle_setup
+        {
+            Eigen::Vector3f inv_w;
+            Eigen::Vector3f z_over_w;
+            Eigen::Vector3f dh_dx, dh_dy;
+        };
+        std::vector<triangle_setup> screen_setup;
+        std::vector<std::vector<std::vector<int>>> bins;
+        std::vector<std::vector<Triangle>> chunk_tris;
+        std::vector<std::vector<std::array<Eigen::Vector3f, 3>>> chunk_view_pos;
+        std::vector<cull_stats> chunk_stats;
+
         int next_id = 0;
         int get_next_id() { return next_id++; }
     };
+
+    // Wraps a plain shader function in a function object so it can be passed to the template draw()
+    // and inlined, e.g. r.draw(pos, ind, col, Primitive::Triangle, rst::static_shader<phong_fragment_shader>{})
+    template <auto F>
+    struct static_shader
+    {
+        template <typename Payload>
+        auto operator()(const Payload& payload) const -> decltype(F(payload)) { return F(payload); }
+    };
+
+    // Half-space setup of a screen-space triangle. Edge i is the edge opposite vertex i, a linear
+    // function E_i(x, y) oriented so that the interior is positive; E_i / area is then the barycentric
+    // weight of vertex i. T is float, or int64_t for fixed-point coordinates.
+    template <typename T>
+    struct edge_setup
+    {
+        T a[3], b[3];
+        T origin[3];  // E_i at the center of pixel (x0, y0)
+        T step_x[3];  // E_i increment per pixel in x
+        T step_y[3];  // E_i increment per pixel in y
+        bool top_left[3];
+        T area;
+    };
+
+    // Top-left fill rule: a sample exactly on an edge belongs to the triangle only if the edge is a
+    // top edge or a left edge, so pixels on an edge shared by two triangles are drawn exactly once.
+    template <typename T>
+    inline bool edge_covers(T e, bool top_left)
+    {
+        return e > 0 || (e == 0 && top_left);
+    }
+
+    // Sets up the edge functions from vertex positions given in units of 1 / unit pixels, evaluated at
+    // the center of pixel (x0, y0).
+    template <typename T>
+    bool setup_edges(const T (&px)[3], const T (&py)[3], T unit, int x0, int y0, edge_setup<T>& es)
+    {
+        es.area = (px[1] - px[0]) * (py[2] - py[0]) - (py[1] - py[0]) * (px[2] - px[0]);
+        if (es.area == 0)
+            return false;
+
+        T sign = es.area > 0 ? T(1) : T(-1);
+        es.area *= sign;
+
+        T cx = T(x0) * unit + unit / 2;
+        T cy = T(y0) * unit + unit / 2;
+        for (int i = 0; i < 3; ++i)
+        {
+            int j = (i + 1) % 3, k = (i + 2) % 3;
+            es.a[i] = sign * (py[j] - py[k]);
+            es.b[i] = sign * (px[k] - px[j]);
+            es.origin[i] = es.a[i] * (cx - px[j]) + es.b[i] * (cy - py[j]);
+            es.step_x[i] = es.a[i] * unit;
+            es.step_y[i] = es.b[i] * unit;
+            // With y pointing up, left edges run downwards and top edges run right to left
+            es.top_left[i] = es.a[i] > 0 || (es.a[i] == 0 && es.b[i] < 0);
+        }
+        return true;
+    }
+
+    // Walks the pixels of [x0, x1] x [y0, y1] (x0, y0 >= 0) in block x block squares aligned to the
+    // screen grid, stepping the edge functions incrementally. A block is skipped if it lies entirely
+    // outside one edge or if visit_block(bx, by) returns false. Otherwise frag(x, y, alpha, beta, gamma)
+    // is called for each covered pixel center, followed by end_block(bx, by).
+    template <typename T, typename Visit, typename Frag, typename End>
+    void traverse_edges(const edge_setup<T>& es, int x0, int x1, int y0, int y1, int block,
+                        Visit&& visit_block, Frag&& frag, End&& end_block)
+    {
+        float inv_area = 1.0f / (float)es.area;
+        for (int by = y0 / block; by <= y1 / block; ++by)
+        {
+            int py0 = std::max(y0, by * block), py1 = std::min(y1, by * block + block - 1);
+            for (int bx = x0 / block; bx <= x1 / block; ++bx)
+            {
+                int px0 = std::max(x0, bx * block), px1 = std::min(x1, bx * block + block - 1);
+
+                T row[3];
+                bool outside = false;
+                for (int i = 0; i < 3; ++i)
+                {
+                    row[i] = es.origin[i] + es.step_x[i] * T(px0 - x0) + es.step_y[i] * T(py0 - y0);
+                    // Largest value of the edge function over the block's pixel centers
+                    T e_max = row[i] + std::max(es.step_x[i] * T(px1 - px0), T(0)) + std::max(es.step_y[i] * T(py1 - py0), T(0));
+                    outside |= !edge_covers(e_max, es.top_left[i]);
+                }
+                if (outside || !visit_block(bx, by))
+                    continue;
+
+                for (int y = py0; y <= py1; ++y)
+                {
+                    T e0 = row[0], e1 = row[1], e2 = row[2];
+                    for (int x = px0; x <= px1; ++x)
+                    {
+                        if (edge_covers(e0, es.top_left[0]) && edge_covers(e1, es.top_left[1]) && edge_covers(e2, es.top_left[2]))
+                            frag(x, y, (float)e0 * inv_area, (float)e1 * inv_area, (float)e2 * inv_area);
+                        e0 += es.step_x[0];
+                        e1 += es.step_x[1];
+                        e2 += es.step_x[2];
+                    }
+                    for (int i = 0; i < 3; ++i)
+                        row[i] += es.step_y[i];
+                }
+                end_block(bx, by);
+            }
+        }
+    }
+
+    // Runs task(i) for every i in [0, count) on up to num_threads threads, handing tasks out in order.
+    template <typename Task>
+    void parallel_for(int count, int num_threads, Task&& task)
+    {
+        num_threads = std::min(num_threads, count);
+        if (num_threads <= 1)
+        {
+            for (int i = 0; i < count; ++i)
+                task(i);
+            return;
+        }
+
+        std::atomic<int> next{0};
+        auto worker = [&]() {
+            for (int i = next++; i < count; i = next++)
+                task(i);
+        };
+        std::vector<std::thread> threads;
+        for (int k = 1; k < num_threads; ++k)
+            threads.emplace_back(worker);
+        worker();
+        for (auto& th : threads)
+            th.join();
+    }
+
+    template <typename Shader>
+    void rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type, const Shader& shader)
+    {
+        process_vertices(pos_buffer, ind_buffer, col_buffer, type);
+        bin_triangles();
+        rasterize_tiles(shader);
+    }
+
+    template <typename Shader>
+    void rasterizer::draw(std::vector<Triangle *> &TriangleList, const Shader& shader)
+    {
+        process_vertices(TriangleList);
+        bin_triangles();
+        rasterize_tiles(shader);
+    }
+
+    // Rasterizes and shades the binned screen_tris, one task per tile. A tile is only ever touched
+    // by the thread rasterizing it, so its slice of frame_buf and depth_buf needs no locking. In
+    // deferred mode the tile is first rasterized into the visibility buffer and then shaded once per
+    // covered pixel.
+    template <typename Shader>
+    void rasterizer::rasterize_tiles(const Shader& shader)
+    {
+        bool deferred = !is_depth_only<Shader> && (is_quad_shader<Shader> || shading == Shading::Deferred);
+        if (deferred && (int)vis_id.size() != frame_buf.size())
+        {
+            vis_id.resize(frame_buf.size());
+            vis_bary.resize(frame_buf.size());
+        }
+        if (deferred && !lights.empty())
+            screen_to_view = (viewport() * projection).inverse();
+
+        int tiles_x = (width + tile_size - 1) / tile_size;
+        int tiles_y = (height + tile_size - 1) / tile_size;
+        profile_clock::time_point pass_start;
+        if (profiling)
+        {
+            tile_profiles.assign(tiles_x * tiles_y, {});
+            pass_start = profile_clock::now();
+        }
+        parallel_for(tiles_x * tiles_y, num_threads, [&](int tile) {
+            profile_clock::time_point tile_start;
+            if (profiling)
+                tile_start = profile_clock::now();
+            rect tile_rect;
+            tile_rect.x0 = (tile % tiles_x) * tile_size;
+            tile_rect.y0 = (tile / tiles_x) * tile_size;
+            tile_rect.x1 = std::min(tile_rect.x0 + tile_size, width) - 1;
+            tile_rect.y1 = std::min(tile_rect.y0 + tile_size, height) - 1;
+            if (deferred)
+            {
+                for (int y = tile_rect.y0; y <= tile_rect.y1; ++y)
+                {
+                    int row = get_index(tile_rect.x0, y);
+                    std::fill_n(vis_id.begin() + row, tile_rect.x1 - tile_rect.x0 + 1, -1);
+                }
+            }
+
+            for (const auto& chunk_bins : bins)
+                for (int i : chunk_bins[tile])
+                    rasterize_triangle(screen_tris[i], screen_view_pos[i], i, tile_rect, shader);
+
+            if constexpr (!is_depth_only<Shader>)
+            {
+                if (deferred)
+                {
+                    if (profiling)
+                    {
+                        tile_profiles[tile].raster += nanoseconds_since(tile_start);
+                        tile_start = profile_clock::now();
+                    }
+                    if (!lights.empty())
+                        cull_lights(tile_rect);
+                    resolve_tile(tile_rect, shader);
+                    if (profiling)
+                        tile_profiles[tile].resolve += nanoseconds_since(tile_start);
+                    return;
+                }
+            }
+            if (profiling)
+                tile_profiles[tile].raster += nanoseconds_since(tile_start);
+        });
+        if (profiling)
+            add_tile_profiles(deferred, nanoseconds_since(pass_start));
+    }
+
+    template <typename Shader>
+    void rasterizer::draw_objects(const std::vector<draw_object>& objects, const Shader& shader)
+    {
+        // Clip-space w grows with the distance in front of the camera
+        Eigen::Vector4f w_row = w_sign * projection.row(3).transpose();
+        std::vector<std::pair<float, int>> order;
+        for (int i = 0; i < (int)objects.size(); ++i)
+        {
+            Eigen::Matrix4f mv = view * objects[i].model;
+            const Eigen::Vector4f& sphere = pos_bounds.at(objects[i].pos.pos_id);
+            Eigen::Vector4f center = mv * sphere.head<3>().homogeneous();
+            float radius = sphere.w() * mv.topLeftCorner<3, 3>().colwise().norm().maxCoeff();
+            order.emplace_back(w_row.dot(center) - radius * w_row.head<3>().norm(), i);
+        }
+        std::stable_sort(order.begin(), order.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        // Objects without buffers of their own use these, and later draws find them back in place
+        int loaded_normal_id = normal_id, loaded_texcoord_id = texcoord_id;
+        for (const auto& entry : order)
+        {
+            const draw_object& object = objects[entry.second];
+            set_model(object.model);
+            if (occlusion_culling && occluded(object.pos))
+            {
+                // Counted at the level of detail draw() would have picked
+                int ind_id = object.ind.ind_id;
+                auto lod = lods.find(ind_id);
+                if (lod != lods.end())
+                    ind_id = lod->second[select_lod(pos_bounds.at(object.pos.pos_id), ind_id, view * model)].ind_id;
+                int num_tris = (int)ind_buf[ind_id].size();
+                stats.submitted += num_tris;
+                stats.occluded += num_tris;
+                continue;
+            }
+            normal_id = object.normals.col_id >= 0 ? object.normals.col_id : loaded_normal_id;
+            texcoord_id = object.texcoords.tex_id >= 0 ? object.texcoords.tex_id : loaded_texcoord_id;
+            draw(object.pos, object.ind, object.col, Primitive::Triangle, shader);
+        }
+        normal_id = loaded_normal_id;
+        texcoord_id = loaded_texcoord_id;
+    }
+
+    //Screen space rasterization
+    template <typename Shader>
+    void rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos, int id, const rect& clip, const Shader& shader)
+    {
+        // TODO: From your HW3, get the triangle rasterization code.
+        // TODO: Inside your rasterization loop:
+        //    * v[i].w() is the vertex view space depth value z.
+        //    * Z is interpolated view space depth for the current pixel
+        //    * zp is depth between zNear and zFar, used for z-buffer
+    
+        // 获取三角形顶点
+        const auto& v0 = t.v[0];
+        const auto& v1 = t.v[1];
+        const auto& v2 = t.v[2];
+        // 计算包围盒
+        float min_x = std::min({v0.x(), v1.x(), v2.x()});
+        float max_x = std::max({v0.x(), v1.x(), v2.x()});
+        float min_y = std::min({v0.y(), v1.y(), v2.y()});
+        float max_y = std::max({v0.y(), v1.y(), v2.y()});
+        // 限制在当前 tile 范围内
+        if (max_x < clip.x0 || min_x >= clip.x1 + 1 || max_y < clip.y0 || min_y >= clip.y1 + 1)
+            return;
+        int x0 = std::max(clip.x0, (int)min_x), x1 = std::min(clip.x1, (int)max_x);
+        int y0 = std::max(clip.y0, (int)min_y), y1 = std::min(clip.y1, (int)max_y);
+
+        // float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
+        // float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
+        // zp *= Z;
+
+        // TODO: Interpolate the attributes:
+        // auto interpolated_color
+        // auto interpolated_normal
+        // auto interpolated_texcoords
+        // auto interpolated_shadingcoords
+
+        // Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
+        // Use: payload.view_pos = interpolated_shadingcoords;
+        // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
+        // Use: auto pixel_color = fragment_shader(payload);
+        // Hierarchical Z: while all w share a sign the interpolated depth is a weighted mean of the
+        // vertex depths, so a block whose farthest stored depth is not behind the triangle's nearest
+        // vertex cannot pass a single depth test.
+        bool same_side = v0.w() * v1.w() > 0 && v0.w() * v2.w() > 0;
+        float tri_min_z = same_side ? std::min({v0.z(), v1.z(), v2.z()}) : -std::numeric_limits<float>::infinity();
+        bool block_written = false;
+        auto visit_block = [&](int bx, int by) {
+            block_written = false;
+            return tri_min_z < hiz_buf[by * hiz_width + bx];
+        };
+        auto end_block = [&](int bx, int by) {
+            if (block_written)
+                update_hiz(bx, by);
+        };
+
+        bool deferred = !is_depth_only<Shader> && (is_quad_shader<Shader> || shading == Shading::Deferred);
+        const triangle_setup& setup = screen_setup[id];
+        auto fragment = [&](int x, int y, float alpha, float beta, float gamma) {
+            // 透视矫正插值: 1/w 和 z/w 在屏幕空间是线性的，每个片元只需一次倒数
+            Eigen::Vector3f bary(alpha, beta, gamma);
+            float w_reciprocal = 1.0f / setup.inv_w.dot(bary);
+            float z_interpolated = setup.z_over_w.dot(bary) * w_reciprocal;
+
+            // 转化成一维索引
+            int buf_index = get_index(x, y);
+            //颜色深度插值
+            if (depth_buf.nearer(buf_index, z_interpolated)) {
+                depth_buf.set(buf_index, z_interpolated);
+                block_written = true;
+                if constexpr (!is_depth_only<Shader>)
+                {
+                    Eigen::Vector3f corrected = bary.cwiseProduct(setup.inv_w) * w_reciprocal;
+                    if (deferred)
+                    {
+                        vis_id[buf_index] = id;
+                        vis_bary[buf_index] = corrected;
+                    }
+                    else if constexpr (!is_quad_shader<Shader>)
+                    {
+                        shade_fragment(t, view_pos, x, y, corrected.x(), corrected.y(), corrected.z(), nullptr, shader);
+                    }
+                }
+            }
+        };
+
+        // 遍历包围盒内所有像素, 边函数按像素增量步进
+        // Fixed-point mode snaps vertices to a 1/2^subpixel_bits grid; it falls back to floats when
+        // the coordinates would overflow the 64-bit edge products.
+        float limit = (float)(1 << (30 - subpixel_bits));
+        bool fixed = subpixel_bits > 0 &&
+                     std::max({std::abs(min_x), std::abs(max_x), std::abs(min_y), std::abs(max_y)}) < limit;
+        if (fixed)
+        {
+            int64_t unit = int64_t(1) << subpixel_bits;
+            int64_t px[3], py[3];
+            for (int i = 0; i < 3; ++i)
+            {
+                px[i] = std::llround(t.v[i].x() * unit);
+                py[i] = std::llround(t.v[i].y() * unit);
+            }
+            edge_setup<int64_t> es;
+            if (setup_edges(px, py, unit, x0, y0, es))
+                traverse_edges(es, x0, x1, y0, y1, hiz_block, visit_block, fragment, end_block);
+        }
+        else
+        {
+            float px[3] = {v0.x(), v1.x(), v2.x()};
+            float py[3] = {v0.y(), v1.y(), v2.y()};
+            edge_setup<float> es;
+            if (setup_edges(px, py, 1.0f, x0, y0, es))
+                traverse_edges(es, x0, x1, y0, y1, hiz_block, visit_block, fragment, end_block);
+        }
+    }
+
+    // Interpolates the attributes of t at the given perspective-correct barycentric weights and runs
+    // the fragment shader. tile_light_list is the light list of the pixel's tile, null to leave every
+    // light to the shader.
+    template <typename Shader>
+    inline void rasterizer::shade_fragment(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos, int x, int y, float alpha, float beta, float gamma,
+                                           const std::vector<int>* tile_light_list, const Shader& shader)
+    {
+        profile_clock::time_point start;
+        if (profiling)
+            start = profile_clock::now();
+        // 插值属性: 权重已经做过透视矫正
+        auto interpolated_color = alpha*t.color[0]+ beta*t.color[1]+gamma*t.color[2];
+        auto interpolated_normal = alpha*t.normal[0]+ beta*t.normal[1]+gamma*t.normal[2];
+        auto interpolated_texcoords = alpha*t.tex_coords[0]+ beta*t.tex_coords[1]+gamma*t.tex_coords[2];
+        auto interpolated_shadingcoords = alpha*view_pos[0]+ beta*view_pos[1]+gamma*view_pos[2];
+
+        // 构造payload
+        fragment_shader_payload payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
+        payload.view_pos = interpolated_shadingcoords;
+        payload.lights = lights.empty() ? nullptr : &lights;
+        payload.tile_lights = tile_light_list;
+        payload.shadow_maps = shadow_maps.empty() ? nullptr : &shadow_maps;
+        // 着色
+        Eigen::Vector3f pixel_color = shader(payload);
+        frame_buf.set(get_index(x, y), pixel_color);
+        if (profiling)
+        {
+            tile_profile& tile = profile_at(x, y);
+            tile.shading += nanoseconds_since(start);
+            tile.fragments++;
+        }
+    }
+
+    // Deferred shading: runs the fragment shader once for every pixel of the tile that the visibility
+    // pass left covered, using the triangle id and barycentrics it stored there. Quad shaders run on
+    // the 2x2 quads of the tile instead; tiles start at even pixels, so quads never straddle tiles.
+    template <typename Shader>
+    void rasterizer::resolve_tile(const rect& tile, const Shader& shader)
+    {
+        if constexpr (is_quad_shader<Shader>)
+        {
+            for (int y = tile.y0; y <= tile.y1; y += 2)
+                for (int x = tile.x0; x <= tile.x1; x += 2)
+                    shade_quad(x, y, shader);
+        }
+        else
+        {
+            for (int y = tile.y0; y <= tile.y1; ++y)
+            {
+                for (int x = tile.x0; x <= tile.x1; ++x)
+                {
+                    int buf_index = get_index(x, y);
+                    int id = vis_id[buf_index];
+                    if (id < 0)
+                        continue;
+                    const Eigen::Vector3f& bary = vis_bary[buf_index];
+                    shade_fragment(screen_tris[id], screen_view_pos[id], x, y, bary.x(), bary.y(), bary.z(),
+                                   lights.empty() ? nullptr : lights_at(x, y), shader);
+                }
+            }
+        }
+    }
+
+    // Shades the quad with lower left pixel (x, y). Each triangle visible in the quad is shaded once
+    // over all four lanes, lanes it does not cover being helper lanes whose barycentrics are
+    // extrapolated along the triangle's screen-space planes of barycentrics / w and then divided
+    // by their sum; only its own lanes are written.
+    template <typename Shader>
+    void rasterizer::shade_quad(int x, int y, const Shader& shader)
+    {
+        profile_clock::time_point start;
+        if (profiling)
+            start = profile_clock::now();
+        int calls = 0;
+        int ids[4];
+        for (int i = 0; i < 4; ++i)
+        {
+            int lx = x + (i & 1), ly = y + (i >> 1);
+            ids[i] = lx < width && ly < height ? vis_id[get_index(lx, ly)] : -1;
+        }
+
+        for (int first = 0; first < 4; ++first)
+        {
+            int id = ids[first];
+            if (id < 0 || std::find(ids, ids + first, id) != ids + first)
+                continue;
+            const Triangle& t = screen_tris[id];
+            const std::array<Eigen::Vector3f, 3>& view_pos = screen_view_pos[id];
+            const triangle_setup& setup = screen_setup[id];
+
+            // barycentrics / w at the first lane: the stored weights scaled by 1/w there, which is
+            // 1 / (weights . w)
+            int fx = x + (first & 1), fy = y + (first >> 1);
+            Eigen::Vector3f origin = vis_bary[get_index(fx, fy)];
+            origin /= origin.dot(Eigen::Vector3f(t.v[0].w(), t.v[1].w(), t.v[2].w()));
+            quad3f bary;
+            for (int i = 0; i < 4; ++i)
+            {
+                int lx = x + (i & 1), ly = y + (i >> 1);
+                if (ids[i] == id)
+                {
+                    bary.row(i) = vis_bary[get_index(lx, ly)].transpose().array();
+                }
+                else
+                {
+                    Eigen::Vector3f h = origin + (lx - fx) * setup.dh_dx + (ly - fy) * setup.dh_dy;
+                    bary.row(i) = (h / h.sum()).transpose().array();
+                }
+            }
+
+            fragment_quad_payload payload;
+            for (int c = 0; c < 3; ++c)
+            {
+                payload.color.col(c) = bary.col(0) * t.color[0][c] + bary.col(1) * t.color[1][c] + bary.col(2) * t.color[2][c];
+                payload.normal.col(c) = bary.col(0) * t.normal[0][c] + bary.col(1) * t.normal[1][c] + bary.col(2) * t.normal[2][c];
+                payload.view_pos.col(c) = bary.col(0) * view_pos[0][c] + bary.col(1) * view_pos[1][c] + bary.col(2) * view_pos[2][c];
+            }
+            for (int c = 0; c < 2; ++c)
+                payload.tex_coords.col(c) = bary.col(0) * t.tex_coords[0][c] + bary.col(1) * t.tex_coords[1][c] + bary.col(2) * t.tex_coords[2][c];
+            payload.normal.colwise() *= payload.normal.square().rowwise().sum().rsqrt();
+            payload.texture = texture ? &*texture : nullptr;
+            payload.lights = lights.empty() ? nullptr : &lights;
+            payload.tile_lights = lights.empty() ? nullptr : lights_at(x, y);
+            payload.shadow_maps = shadow_maps.empty() ? nullptr : &shadow_maps;
+
+            quad3f colors = shader(payload);
+            calls++;
+            for (int i = 0; i < 4; ++i)
+                if (ids[i] == id)
+                    frame_buf.set(get_index(x + (i & 1), y + (i >> 1)), colors.row(i).transpose().matrix());
+        }
+        if (profiling && calls > 0)
+        {
+            tile_profile& tile = profile_at(x, y);
+            tile.shading += nanoseconds_since(start);
+            tile.fragments += 4 * calls;
+        }
+    }
 }
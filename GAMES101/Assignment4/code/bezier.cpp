@@ -0,0 +1,92 @@
+//
+// Flattening of Bezier curves into polylines by adaptive de Casteljau subdivision.
+//
+
+#include "bezier.hpp"
+
+namespace
+{
+    struct curve_piece
+    {
+        cv::Point2f points[max_bezier_points];
+        int depth;
+    };
+
+    // Whether every control point lies within tolerance of the chord from the first to the last one.
+    // The distance is to the chord as a segment, not as a line, so that a piece that loops back past
+    // its endpoints is not taken for flat.
+    bool is_flat(const cv::Point2f* points, int count, float tolerance)
+    {
+        cv::Point2f chord = points[count - 1] - points[0];
+        float length_squared = chord.dot(chord);
+        float tolerance_squared = tolerance * tolerance;
+        for (int i = 1; i < count - 1; ++i)
+        {
+            cv::Point2f offset = points[i] - points[0];
+            float along = chord.dot(offset);
+            float distance_squared;
+            if (along <= 0)
+            {
+                distance_squared = offset.dot(offset);
+            }
+            else if (along >= length_squared)
+            {
+                cv::Point2f past = points[i] - points[count - 1];
+                distance_squared = past.dot(past);
+            }
+            else
+            {
+                float cross = chord.x * offset.y - chord.y * offset.x;
+                distance_squared = cross * cross / length_squared;
+            }
+            if (distance_squared > tolerance_squared)
+                return false;
+        }
+        return true;
+    }
+
+    // Splits the curve at t = 1/2 into left and right, which may alias points
+    void split_half(const cv::Point2f* points, int count, cv::Point2f* left, cv::Point2f* right)
+    {
+        cv::Point2f level[max_bezier_points];
+        for (int i = 0; i < count; ++i)
+            level[i] = points[i];
+        for (int k = 0; k < count; ++k)
+        {
+            left[k] = level[0];
+            right[count - 1 - k] = level[count - 1 - k];
+            for (int i = 0; i < count - 1 - k; ++i)
+                level[i] = 0.5f * (level[i] + level[i + 1]);
+        }
+    }
+}
+
+void flatten_bezier(const cv::Point2f* points, int count, float tolerance, std::vector<cv::Point2f>& polyline)
+{
+    if (count < 2 || count > max_bezier_points)
+        return;
+
+    // Depth-first: the right half of every split waits on the stack while the left half goes on, so
+    // the points come out in order and at most one piece per level is pending
+    curve_piece stack[max_bezier_depth + 1];
+    int pending = 0;
+    curve_piece current;
+    for (int i = 0; i < count; ++i)
+        current.points[i] = points[i];
+    current.depth = 0;
+
+    while (true)
+    {
+        if (current.depth == max_bezier_depth || is_flat(current.points, count, tolerance))
+        {
+            polyline.push_back(current.points[count - 1]);
+            if (pending == 0)
+                break;
+            current = stack[--pending];
+            continue;
+        }
+        curve_piece& right = stack[pending++];
+        split_half(current.points, count, current.points, right.points);
+        right.depth = ++current.depth;
+    }
+}
@@ -0,0 +1,23 @@
+//
+// Flattening of Bezier curves into polylines by adaptive de Casteljau subdivision.
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+// Highest number of control points flatten_bezier() accepts, a curve of degree 15
+constexpr int max_bezier_points = 16;
+
+// Deepest subdivision flatten_bezier() makes. A piece at this depth spans 2^-20 of the parameter
+// range and is emitted whether it is flat or not.
+constexpr int max_bezier_depth = 20;
+
+// Appends to polyline the points of a polyline that stays within tolerance of the curve with the
+// count control points, without its first point, which is points[0]. A piece of the curve is
+// emitted as one segment once all its control points lie within tolerance of its chord; by the
+// convex hull property the piece then does too. Curves without count in [2, max_bezier_points] are
+// ignored. Apart from growing polyline, no memory is allocated, so a polyline that is cleared and
+// reused between curves keeps the whole loop free of allocations.
+void flatten_bezier(const cv::Point2f* points, int count, float tolerance, std::vector<cv::Point2f>& polyline);
@@ -0,0 +1,122 @@
+//
+// Evaluation of large batches of Bezier and uniform B-spline curves of one degree.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include "curve_batch.hpp"
+#include "parallel.hpp"
+
+namespace
+{
+    // Cardinal B-spline of degree k, nonzero on [0, k + 1)
+    double cardinal_bspline(int k, double x)
+    {
+        if (k == 0)
+            return x >= 0 && x < 1 ? 1 : 0;
+        return (x * cardinal_bspline(k - 1, x) + (k + 1 - x) * cardinal_bspline(k - 1, x - 1)) / k;
+    }
+}
+
+void curve_basis_weights(curve_basis basis, int degree, float u, float* weights)
+{
+    if (basis == curve_basis::bezier)
+    {
+        // Bernstein polynomials C(n, j) u^j (1 - u)^(n - j)
+        double binomial = 1;
+        for (int j = 0; j <= degree; ++j)
+        {
+            weights[j] = (float)(binomial * std::pow(u, j) * std::pow(1 - u, degree - j));
+            binomial = binomial * (degree - j) / (j + 1);
+        }
+    }
+    else
+    {
+        // Control point j of the span is the one whose basis function started degree - j knots
+        // before the span. u = 1 is taken as the limit from inside the span.
+        double x = std::min((double)u, 1 - 1e-9);
+        for (int j = 0; j <= degree; ++j)
+            weights[j] = (float)cardinal_bspline(degree, x + degree - j);
+    }
+}
+
+curve_batch::curve_batch(curve_basis basis, int degree, int points_per_curve)
+    : basis(basis), degree(degree), points_per_curve(points_per_curve)
+{
+    if (degree < 1 || degree > max_degree)
+        throw std::invalid_argument("curve degree must be between 1 and 15");
+    span_step = basis == curve_basis::bezier ? degree : 1;
+    if (points_per_curve < degree + 1 || (points_per_curve - 1 - degree) % span_step != 0)
+        throw std::invalid_argument("control point count does not make whole spans of the curve degree");
+    num_spans = (points_per_curve - 1 - degree) / span_step + 1;
+    block_floats = 2 * points_per_curve * curve_lanes;
+}
+
+void curve_batch::add(const cv::Point2f* points)
+{
+    int lane = num_curves % curve_lanes;
+    if (lane == 0)
+        control.resize(control.size() + block_floats, 0.0f);
+    float* dst = block(num_curves / curve_lanes);
+    for (int k = 0; k < points_per_curve; ++k)
+    {
+        dst[(2 * k) * curve_lanes + lane] = points[k].x;
+        dst[(2 * k + 1) * curve_lanes + lane] = points[k].y;
+    }
+    ++num_curves;
+}
+
+void curve_batch::reserve(int curves)
+{
+    control.reserve((size_t)(curves + curve_lanes - 1) / curve_lanes * block_floats);
+}
+
+void curve_batch::clear()
+{
+    control.clear();
+    num_curves = 0;
+}
+
+void curve_batch::evaluate(int samples_per_span, std::vector<cv::Point2f>& points, int num_threads) const
+{
+    samples_per_span = std::max(1, samples_per_span);
+    int per_curve = samples_per_curve(samples_per_span);
+    points.resize((size_t)num_curves * per_curve);
+
+    // One row of degree + 1 weights per sample of a span, the last row being u = 1
+    int row = degree + 1;
+    std::vector<float> weights((samples_per_span + 1) * row);
+    for (int i = 0; i <= samples_per_span; ++i)
+        curve_basis_weights(basis, degree, (float)i / samples_per_span, &weights[i * row]);
+
+    int num_blocks = (num_curves + curve_lanes - 1) / curve_lanes;
+    parallel_for(num_blocks, num_threads, [&](int b) {
+        const float* src = block(b);
+        int lanes = std::min(curve_lanes, num_curves - b * curve_lanes);
+        cv::Point2f* dst = points.data() + (size_t)b * curve_lanes * per_curve;
+        for (int s = 0; s < num_spans; ++s)
+        {
+            const float* span = src + 2 * s * span_step * curve_lanes;
+            int samples = s == num_spans - 1 ? samples_per_span + 1 : samples_per_span;
+            for (int i = 0; i < samples; ++i)
+            {
+                const float* w = &weights[i * row];
+                float x[curve_lanes] = {}, y[curve_lanes] = {};
+                for (int j = 0; j <= degree; ++j)
+                {
+                    const float* px = span + 2 * j * curve_lanes;
+                    const float* py = px + curve_lanes;
+                    for (int l = 0; l < curve_lanes; ++l)
+                    {
+                        x[l] += w[j] * px[l];
+                        y[l] += w[j] * py[l];
+                    }
+                }
+                int index = s * samples_per_span + i;
+                for (int l = 0; l < lanes; ++l)
+                    dst[(size_t)l * per_curve + index] = cv::Point2f(x[l], y[l]);
+            }
+        }
+    });
+}
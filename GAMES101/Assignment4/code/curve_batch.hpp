@@ -0,0 +1,66 @@
+//
+// Evaluation of large batches of Bezier and uniform B-spline curves of one degree.
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+enum class curve_basis
+{
+    // Composite Bezier curve: span s uses control points [s * degree, s * degree + degree], so
+    // neighbouring spans share an endpoint
+    bezier,
+    // Uniform B-spline: span s uses control points [s, s + degree]
+    uniform_bspline
+};
+
+// Curves of one basis, degree and control point count, evaluated together at fixed parameter steps.
+// The control points are stored in blocks of curve_lanes curves, each block as one array of x and one
+// of y per control point index, so evaluation computes curve_lanes curves at once with the same
+// weights. The weights of every sample are tabulated once per call to evaluate().
+class curve_batch
+{
+public:
+    static constexpr int curve_lanes = 8;
+    static constexpr int max_degree = 15;
+
+    // Throws std::invalid_argument if degree is not in [1, max_degree] or points_per_curve does not
+    // make at least one whole span
+    curve_batch(curve_basis basis, int degree, int points_per_curve);
+
+    // Appends a curve with points_per_curve control points
+    void add(const cv::Point2f* points);
+    void reserve(int curves);
+    void clear();
+
+    int size() const { return num_curves; }
+    int spans() const { return num_spans; }
+    // Points evaluate() writes per curve: samples_per_span per span and the end of the curve
+    int samples_per_curve(int samples_per_span) const { return num_spans * samples_per_span + 1; }
+
+    // Evaluates every curve at samples_per_span evenly spaced parameters of each span and at the end
+    // of its last span. Curve i gets points [i * n, (i + 1) * n) of points, with
+    // n = samples_per_curve(samples_per_span), which is resized to fit. The blocks of curves are
+    // handed out to num_threads threads.
+    void evaluate(int samples_per_span, std::vector<cv::Point2f>& points, int num_threads = 1) const;
+
+private:
+    float* block(int b) { return control.data() + (size_t)b * block_floats; }
+    const float* block(int b) const { return control.data() + (size_t)b * block_floats; }
+
+    curve_basis basis;
+    int degree;
+    int points_per_curve;
+    int num_spans;
+    // Index of the first control point of span s is s * span_step
+    int span_step;
+    // 2 * points_per_curve * curve_lanes: x of every lane for control point 0, then y, then control point 1...
+    int block_floats;
+    int num_curves = 0;
+    std::vector<float> control;
+};
+
+// Blending weights of the degree + 1 control points of a span at parameter u in [0, 1]
+void curve_basis_weights(curve_basis basis, int degree, float u, float* weights);
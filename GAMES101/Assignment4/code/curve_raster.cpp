@@ -0,0 +1,131 @@
+//
+// Anti-aliased strokes of polylines, shaded by the distance from each pixel to the polyline.
+//
+
+#include <algorithm>
+#include <cmath>
+#include "curve_raster.hpp"
+
+int stroke_rasterizer::draw(const cv::Point2f* polyline, int count, float width, cv::Vec3b color, cv::Mat& window)
+{
+    if (count < 1 || width <= 0)
+        return 0;
+
+    // Strokes thinner than a pixel are drawn a pixel wide and faded by their width
+    float half_width = std::max(0.5f * width, 0.5f);
+    float fade = std::min(width, 1.0f);
+    // Pixels whose centers are farther than reach from the polyline have no coverage
+    float reach = half_width + 0.5f;
+
+    segments.clear();
+    float min_x = polyline[0].x, max_x = min_x, min_y = polyline[0].y, max_y = min_y;
+    for (int i = 0; i < std::max(count - 1, 1); ++i)
+    {
+        cv::Point2f a = polyline[i], b = polyline[std::min(i + 1, count - 1)];
+        cv::Point2f d = b - a;
+        float length_squared = d.dot(d);
+        segments.push_back({a, d, length_squared > 0 ? 1 / length_squared : 0.0f});
+        min_x = std::min(min_x, b.x);
+        max_x = std::max(max_x, b.x);
+        min_y = std::min(min_y, b.y);
+        max_y = std::max(max_y, b.y);
+    }
+
+    // The grid only spans the cells of the stroke's bounding box, clipped to the window
+    int grid_x0 = std::max(0, (int)std::floor((min_x - reach) / cell_size));
+    int grid_y0 = std::max(0, (int)std::floor((min_y - reach) / cell_size));
+    int grid_x1 = std::min((window.cols - 1) / cell_size, (int)std::floor((max_x + reach) / cell_size));
+    int grid_y1 = std::min((window.rows - 1) / cell_size, (int)std::floor((max_y + reach) / cell_size));
+    if (grid_x0 > grid_x1 || grid_y0 > grid_y1)
+        return 0;
+    int grid_width = grid_x1 - grid_x0 + 1;
+    int num_cells = grid_width * (grid_y1 - grid_y0 + 1);
+
+    // Calls visit(cell) for the cells of every row that the part of the segment within reach of
+    // the row's band of pixels comes within reach of
+    auto for_each_cell = [&](const segment& s, auto&& visit) {
+        float seg_y0 = std::min(s.a.y, s.a.y + s.d.y), seg_y1 = std::max(s.a.y, s.a.y + s.d.y);
+        int row0 = std::max(grid_y0, (int)std::floor((seg_y0 - reach) / cell_size));
+        int row1 = std::min(grid_y1, (int)std::floor((seg_y1 + reach) / cell_size));
+        for (int row = row0; row <= row1; ++row)
+        {
+            float band_y0 = row * cell_size - reach, band_y1 = (row + 1) * cell_size + reach;
+            float t0 = 0, t1 = 1;
+            if (s.d.y != 0)
+            {
+                float ta = (band_y0 - s.a.y) / s.d.y, tb = (band_y1 - s.a.y) / s.d.y;
+                t0 = std::max(t0, std::min(ta, tb));
+                t1 = std::min(t1, std::max(ta, tb));
+            }
+            float xa = s.a.x + t0 * s.d.x, xb = s.a.x + t1 * s.d.x;
+            int col0 = std::max(grid_x0, (int)std::floor((std::min(xa, xb) - reach) / cell_size));
+            int col1 = std::min(grid_x1, (int)std::floor((std::max(xa, xb) + reach) / cell_size));
+            for (int col = col0; col <= col1; ++col)
+                visit((row - grid_y0) * grid_width + col - grid_x0);
+        }
+    };
+
+    // Counting pass, prefix sum, then filling pass
+    cell_start.assign(num_cells + 1, 0);
+    for (const segment& s : segments)
+        for_each_cell(s, [&](int cell) { ++cell_start[cell + 1]; });
+    for (int c = 0; c < num_cells; ++c)
+        cell_start[c + 1] += cell_start[c];
+    cell_segments.resize(cell_start[num_cells]);
+    for (int i = 0; i < (int)segments.size(); ++i)
+        for_each_cell(segments[i], [&](int cell) { cell_segments[cell_start[cell]++] = i; });
+    // Filling advanced every start to the next cell's start
+    for (int c = num_cells; c > 0; --c)
+        cell_start[c] = cell_start[c - 1];
+    cell_start[0] = 0;
+
+    int covered = 0;
+    for (int c = 0; c < num_cells; ++c)
+    {
+        int first = cell_start[c], last = cell_start[c + 1];
+        if (first == last)
+            continue;
+        // Only the pixels within reach of the bounding boxes of the cell's segments
+        int x0 = (grid_x0 + c % grid_width) * cell_size, y0 = (grid_y0 + c / grid_width) * cell_size;
+        int x1 = std::min(x0 + cell_size, window.cols), y1 = std::min(y0 + cell_size, window.rows);
+        float box_x0 = x1, box_y0 = y1, box_x1 = x0, box_y1 = y0;
+        for (int k = first; k < last; ++k)
+        {
+            const segment& s = segments[cell_segments[k]];
+            box_x0 = std::min(box_x0, std::min(s.a.x, s.a.x + s.d.x));
+            box_x1 = std::max(box_x1, std::max(s.a.x, s.a.x + s.d.x));
+            box_y0 = std::min(box_y0, std::min(s.a.y, s.a.y + s.d.y));
+            box_y1 = std::max(box_y1, std::max(s.a.y, s.a.y + s.d.y));
+        }
+        x0 = std::max(x0, (int)std::floor(box_x0 - reach));
+        y0 = std::max(y0, (int)std::floor(box_y0 - reach));
+        x1 = std::min(x1, (int)std::ceil(box_x1 + reach));
+        y1 = std::min(y1, (int)std::ceil(box_y1 + reach));
+
+        for (int y = y0; y < y1; ++y)
+        {
+            for (int x = x0; x < x1; ++x)
+            {
+                cv::Point2f center(x + 0.5f, y + 0.5f);
+                float distance_squared = reach * reach;
+                for (int k = first; k < last; ++k)
+                {
+                    const segment& s = segments[cell_segments[k]];
+                    cv::Point2f offset = center - s.a;
+                    float t = std::min(std::max(offset.dot(s.d) * s.inv_length_squared, 0.0f), 1.0f);
+                    cv::Point2f nearest = offset - t * s.d;
+                    distance_squared = std::min(distance_squared, nearest.dot(nearest));
+                }
+                if (distance_squared >= reach * reach)
+                    continue;
+
+                float coverage = fade * std::min(1.0f, reach - std::sqrt(distance_squared));
+                cv::Vec3b& pixel = window.at<cv::Vec3b>(y, x);
+                for (int k = 0; k < 3; ++k)
+                    pixel[k] = (unsigned char)(pixel[k] + (color[k] - pixel[k]) * coverage + 0.5f);
+                ++covered;
+            }
+        }
+    }
+    return covered;
+}
@@ -0,0 +1,39 @@
+//
+// Anti-aliased strokes of polylines, shaded by the distance from each pixel to the polyline.
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+// Draws polylines, such as those of flatten_bezier(), as strokes whose coverage of a pixel is
+// taken from the distance between its center and the nearest segment. The segments are binned
+// into square cells of the window first, each into every cell within half the stroke width and a
+// pixel of it, so a pixel only measures the distance to the segments of its own cell and the cost
+// per covered pixel does not grow with the length of the polyline. The bins are kept between
+// calls, so drawing many curves with one stroke_rasterizer does not allocate after the first few.
+class stroke_rasterizer
+{
+public:
+    explicit stroke_rasterizer(int cell_size = 8) : cell_size(cell_size) {}
+
+    // Blends color into the CV_8UC3 window with the coverage of the stroke of the given width along
+    // the count points of polyline. A pixel near several segments of the polyline is covered once,
+    // by the nearest of them, so joints are not darker than the rest of the stroke. Returns the
+    // number of pixels with nonzero coverage.
+    int draw(const cv::Point2f* polyline, int count, float width, cv::Vec3b color, cv::Mat& window);
+
+private:
+    struct segment
+    {
+        cv::Point2f a, d;
+        float inv_length_squared;
+    };
+
+    int cell_size;
+    std::vector<segment> segments;
+    // Cell c holds segments cell_segments[cell_start[c], cell_start[c + 1]), once filled
+    std::vector<int> cell_start;
+    std::vector<int> cell_segments;
+};
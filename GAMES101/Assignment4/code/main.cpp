@@ -1,6 +1,13 @@
 #include <chrono>
+#include <cstring>
 #include <iostream>
+#include <random>
+#include <thread>
 #include <opencv2/opencv.hpp>
+#include "bezier.hpp"
+#include "curve_batch.hpp"
+#include "curve_raster.hpp"
+#include "path_fill.hpp"
 
 std::vector<cv::Point2f> control_points;
 
@@ -21,12 +28,24 @@ void naive_bezier(const std::vector<cv::Point2f> &points, cv::Mat &window)
     auto &p_2 = points[2];
     auto &p_3 = points[3];
 
-    for (double t = 0.0; t <= 1.0; t += 0.001) 
-    {
-        auto point = std::pow(1 - t, 3) * p_0 + 3 * t * std::pow(1 - t, 2) * p_1 +
-                 3 * std::pow(t, 2) * (1 - t) * p_2 + std::pow(t, 3) * p_3;
+    // Forward differences of the cubic in power form, B(t) = a t^3 + b t^2 + c t + p_0: three
+    // additions per step instead of four calls to std::pow
+    const double h = 0.001;
+    cv::Point2d a = cv::Point2d(p_3.x - p_0.x, p_3.y - p_0.y) + 3.0 * cv::Point2d(p_1.x - p_2.x, p_1.y - p_2.y);
+    cv::Point2d b = 3.0 * cv::Point2d(p_0.x - 2 * p_1.x + p_2.x, p_0.y - 2 * p_1.y + p_2.y);
+    cv::Point2d c = 3.0 * cv::Point2d(p_1.x - p_0.x, p_1.y - p_0.y);
+    cv::Point2d point(p_0.x, p_0.y);
+    cv::Point2d d1 = a * (h * h * h) + b * (h * h) + c * h;
+    cv::Point2d d2 = a * (6 * h * h * h) + b * (2 * h * h);
+    cv::Point2d d3 = a * (6 * h * h * h);
 
-        window.at<cv::Vec3b>(point.y, point.x)[2] = 255;
+    for (int i = 0; i <= 1000; ++i) 
+    {
+        if (point.x >= 0 && point.x < window.cols && point.y >= 0 && point.y < window.rows)
+            window.at<cv::Vec3b>(point.y, point.x)[2] = 255;
+        point += d1;
+        d1 += d2;
+        d2 += d3;
     }
 }
 
@@ -43,19 +62,249 @@ cv::Point2f recursive_bezier(const std::vector<cv::Point2f> &control_points, flo
     return recursive_bezier(next_points, t);
 }
 
+// Sets channel of every pixel the segment from a to b passes through, one step per pixel along
+// its major axis
+void draw_segment(cv::Point2f a, cv::Point2f b, cv::Mat &window, int channel)
+{
+    cv::Point2f d = b - a;
+    int steps = std::max(1, (int)std::ceil(std::max(std::abs(d.x), std::abs(d.y))));
+    cv::Point2f step = d * (1.0f / steps);
+    cv::Point2f point = a;
+    for (int i = 0; i <= steps; ++i, point += step)
+    {
+        if (point.x >= 0 && point.x < window.cols && point.y >= 0 && point.y < window.rows)
+            window.at<cv::Vec3b>(point.y, point.x)[channel] = 255;
+    }
+}
+
+// Flattening tolerance in pixels. A quarter pixel keeps the polyline on the pixels of the curve.
+constexpr float curve_tolerance = 0.25f;
+
 void bezier(const std::vector<cv::Point2f> &control_points, cv::Mat &window) 
 {
-    for (double t = 0.0; t <= 1.0; t += 0.001) {
-        cv::Point2f point = recursive_bezier(control_points, t);
-        // 防止越界
-        if (point.x >= 0 && point.x < window.cols && point.y >= 0 && point.y < window.rows) {
-            window.at<cv::Vec3b>(point.y, point.x)[1] = 255; // 绿色
-        }
+    std::vector<cv::Point2f> polyline{control_points[0]};
+    flatten_bezier(control_points.data(), control_points.size(), curve_tolerance, polyline);
+    stroke_rasterizer strokes;
+    strokes.draw(polyline.data(), polyline.size(), 1.0f, cv::Vec3b(0, 255, 0), window); // 绿色
+}
+
+// Flattens random cubic curves spanning up to extent pixels of a 700x700 window, both by the fixed
+// 1001 evaluations of recursive_bezier() and adaptively, and prints the rates in curves per second.
+// The flattened curves are then drawn as anti-aliased strokes.
+void run_benchmark(int curves, float extent)
+{
+    std::mt19937 rng(101);
+    std::uniform_real_distribution<float> origin(0, 700 - extent), offset(0, extent);
+    std::vector<cv::Point2f> points(4 * curves);
+    for (int i = 0; i < curves; ++i)
+    {
+        cv::Point2f base(origin(rng), origin(rng));
+        for (int k = 0; k < 4; ++k)
+            points[4 * i + k] = base + cv::Point2f(offset(rng), offset(rng));
+    }
+
+    using clock = std::chrono::steady_clock;
+    float checksum = 0;
+    auto start = clock::now();
+    std::vector<cv::Point2f> curve(4);
+    for (int i = 0; i < curves; ++i)
+    {
+        curve.assign(points.begin() + 4 * i, points.begin() + 4 * i + 4);
+        for (double t = 0.0; t <= 1.0; t += 0.001)
+            checksum += recursive_bezier(curve, t).x;
+    }
+    double fixed_seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::vector<cv::Point2f> polyline;
+    size_t emitted = 0;
+    start = clock::now();
+    for (int i = 0; i < curves; ++i)
+    {
+        polyline.clear();
+        flatten_bezier(&points[4 * i], 4, curve_tolerance, polyline);
+        emitted += polyline.size();
+        checksum += polyline.back().x;
+    }
+    double adaptive_seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    cv::Mat window = cv::Mat(700, 700, CV_8UC3, cv::Scalar(0));
+    stroke_rasterizer strokes;
+    size_t covered = 0;
+    start = clock::now();
+    for (int i = 0; i < curves; ++i)
+    {
+        polyline.clear();
+        polyline.push_back(points[4 * i]);
+        flatten_bezier(&points[4 * i], 4, curve_tolerance, polyline);
+        covered += strokes.draw(polyline.data(), polyline.size(), 1.0f, cv::Vec3b(0, 255, 0), window);
     }
+    double stroke_seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::cout << curves << " cubic curves up to " << extent << " px (checksum " << checksum << ")\n"
+              << "fixed:    " << curves / fixed_seconds << " curves/s, 1001 points per curve\n"
+              << "adaptive: " << curves / adaptive_seconds << " curves/s, "
+              << (double)emitted / curves << " segments per curve at " << curve_tolerance << " px\n"
+              << "stroked:  " << curves / stroke_seconds << " curves/s, " << (double)covered / curves
+              << " pixels per curve, " << stroke_seconds * 1e9 / covered << " ns per pixel\n";
 }
 
-int main() 
+// Evaluates random curves of the given degree and basis, with four spans each, on one thread
+// and on all of them, prints the rates, and draws the curves into batch_curves.png
+void run_batch(int curves, int degree, curve_basis basis)
 {
+    int points_per_curve = basis == curve_basis::bezier ? 4 * degree + 1 : degree + 4;
+    curve_batch batch(basis, degree, points_per_curve);
+    batch.reserve(curves);
+    std::mt19937 rng(72);
+    std::uniform_real_distribution<float> origin(0, 500), offset(0, 200);
+    std::vector<cv::Point2f> points(points_per_curve);
+    for (int i = 0; i < curves; ++i)
+    {
+        cv::Point2f base(origin(rng), origin(rng));
+        for (auto& point : points)
+            point = base + cv::Point2f(offset(rng), offset(rng));
+        batch.add(points.data());
+    }
+
+    const int samples_per_span = 16;
+    std::vector<cv::Point2f> samples;
+    auto time_evaluate = [&](int threads) {
+        auto start = std::chrono::steady_clock::now();
+        batch.evaluate(samples_per_span, samples, threads);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << threads << " thread(s): " << curves / seconds << " curves/s, "
+                  << samples.size() / seconds << " points/s\n";
+    };
+    // The first run faults in the sample buffer and is not timed
+    batch.evaluate(samples_per_span, samples);
+    time_evaluate(1);
+    int num_threads = std::thread::hardware_concurrency();
+    if (num_threads > 1)
+        time_evaluate(num_threads);
+
+    cv::Mat window = cv::Mat(700, 700, CV_8UC3, cv::Scalar(0));
+    int per_curve = batch.samples_per_curve(samples_per_span);
+    for (int i = 0; i < curves; ++i)
+    {
+        const cv::Point2f* curve = &samples[(size_t)i * per_curve];
+        for (int k = 0; k + 1 < per_curve; ++k)
+            draw_segment(curve[k], curve[k + 1], window, 1);
+    }
+    cv::imwrite("batch_curves.png", window);
+}
+
+// Glyph-like outlines about two units across, centered on the origin: a ring of two cubic circles
+// of opposite direction for the nonzero rule, a pentagram for the even-odd rule and a quadratic
+// teardrop
+std::vector<path> glyph_outlines()
+{
+    std::vector<path> glyphs(3);
+    const float k = 0.5523f;
+    for (float r : {1.0f, -0.55f})
+    {
+        glyphs[0].move_to({r, 0});
+        glyphs[0].cubic_to({r, k * std::abs(r)}, {k * r, std::abs(r)}, {0, std::abs(r)});
+        glyphs[0].cubic_to({-k * r, std::abs(r)}, {-r, k * std::abs(r)}, {-r, 0});
+        glyphs[0].cubic_to({-r, -k * std::abs(r)}, {-k * r, -std::abs(r)}, {0, -std::abs(r)});
+        glyphs[0].cubic_to({k * r, -std::abs(r)}, {r, -k * std::abs(r)}, {r, 0});
+    }
+    for (int i = 0; i < 5; ++i)
+    {
+        float angle = i * 4 * 3.14159265f / 5;
+        cv::Point2f point(std::sin(angle), -std::cos(angle));
+        if (i == 0)
+            glyphs[1].move_to(point);
+        else
+            glyphs[1].line_to(point);
+    }
+    glyphs[2].move_to({0, -1});
+    glyphs[2].quad_to({1.2f, 0.6f}, {0, 1});
+    glyphs[2].quad_to({-1.2f, 0.6f}, {0, -1});
+    return glyphs;
+}
+
+// Fills count random glyphs 12 to 40 pixels across, on one thread and on all of them, prints the
+// rates in glyphs per second and writes the frame to glyphs.png
+void run_glyphs(int count)
+{
+    std::vector<path> glyphs = glyph_outlines();
+    std::mt19937 rng(74);
+    std::uniform_real_distribution<float> position(0, 700), size(6, 20);
+    std::uniform_int_distribution<int> shape(0, (int)glyphs.size() - 1), channel(64, 255);
+    struct placed { int shape; float scale; cv::Point2f offset; cv::Vec3b color; };
+    std::vector<placed> frame(count);
+    for (auto& g : frame)
+        g = {shape(rng), size(rng), {position(rng), position(rng)},
+             cv::Vec3b(channel(rng), channel(rng), channel(rng))};
+
+    path_filler filler;
+    cv::Mat window;
+    auto time_frame = [&](int threads) {
+        window = cv::Mat(700, 700, CV_8UC3, cv::Scalar(0));
+        auto start = std::chrono::steady_clock::now();
+        for (const auto& g : frame)
+            filler.add(glyphs[g.shape], g.shape == 1 ? fill_rule::even_odd : fill_rule::nonzero, g.color, g.scale, g.offset);
+        filler.render(window, threads);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << threads << " thread(s): " << count / seconds << " glyphs/s, "
+                  << seconds * 1e3 << " ms per frame\n";
+    };
+    // The first frame grows the filler's buffers and is not timed
+    for (const auto& g : frame)
+        filler.add(glyphs[g.shape], fill_rule::nonzero, g.color, g.scale, g.offset);
+    filler.clear();
+    time_frame(1);
+    int num_threads = std::thread::hardware_concurrency();
+    if (num_threads > 1)
+        time_frame(num_threads);
+    cv::imwrite("glyphs.png", window);
+}
+
+int main(int argc, const char** argv) 
+{
+    // BezierCurve --benchmark [curves] [extent] times the curve flattening without opening a window
+    if (argc >= 2 && std::strcmp(argv[1], "--benchmark") == 0)
+    {
+        int curves = argc >= 3 ? std::atoi(argv[2]) : 20000;
+        float extent = argc >= 4 ? std::atof(argv[3]) : 200.0f;
+        // The curves must fit in the 700x700 window
+        if (curves < 1 || !(extent > 0 && extent <= 700))
+        {
+            std::cerr << "usage: BezierCurve --benchmark [curves] [extent, 0 to 700 pixels]\n";
+            return 1;
+        }
+        run_benchmark(curves, extent);
+        return 0;
+    }
+    // BezierCurve --batch [curves] [degree] [bezier|bspline] evaluates a batch of random curves
+    if (argc >= 2 && std::strcmp(argv[1], "--batch") == 0)
+    {
+        int curves = argc >= 3 ? std::atoi(argv[2]) : 1000000;
+        int degree = argc >= 4 ? std::atoi(argv[3]) : 3;
+        bool bspline = argc >= 5 && std::strcmp(argv[4], "bspline") == 0;
+        if (curves < 1 || degree < 1 || degree > curve_batch::max_degree)
+        {
+            std::cerr << "usage: BezierCurve --batch [curves] [degree, 1 to " << curve_batch::max_degree
+                      << "] [bezier|bspline]\n";
+            return 1;
+        }
+        run_batch(curves, degree, bspline ? curve_basis::uniform_bspline : curve_basis::bezier);
+        return 0;
+    }
+
+    // BezierCurve --glyphs [count] fills a frame of random glyph outlines
+    if (argc >= 2 && std::strcmp(argv[1], "--glyphs") == 0)
+    {
+        int count = argc >= 3 ? std::atoi(argv[2]) : 5000;
+        if (count < 1)
+        {
+            std::cerr << "usage: BezierCurve --glyphs [count]\n";
+            return 1;
+        }
+        run_glyphs(count);
+        return 0;
+    }
+
     cv::Mat window = cv::Mat(700, 700, CV_8UC3, cv::Scalar(0));
     cv::cvtColor(window, window, cv::COLOR_BGR2RGB);
     cv::namedWindow("Bezier Curve", cv::WINDOW_AUTOSIZE);
@@ -72,8 +321,10 @@ int main()
 
         if (control_points.size() == 4) 
         {
-                naive_bezier(control_points, window);
-               bezier(control_points, window);
+            // The anti-aliased curve goes first, so the red channel naive_bezier() sets on top of it
+            // shows where the two agree in yellow
+            bezier(control_points, window);
+            naive_bezier(control_points, window);
 
             cv::imshow("Bezier Curve", window);
             cv::imwrite("my_bezier_curve.png", window);
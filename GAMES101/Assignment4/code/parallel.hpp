@@ -0,0 +1,35 @@
+//
+// Minimal fork-join helper shared by the batch curve evaluation and the path filler.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Runs task(i) for every i in [0, count) on up to num_threads threads, handing tasks out in order.
+template <typename Task>
+void parallel_for(int count, int num_threads, Task&& task)
+{
+    num_threads = std::min(num_threads, count);
+    if (num_threads <= 1)
+    {
+        for (int i = 0; i < count; ++i)
+            task(i);
+        return;
+    }
+
+    std::atomic<int> next{0};
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++)
+            task(i);
+    };
+    std::vector<std::thread> threads;
+    for (int k = 1; k < num_threads; ++k)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& th : threads)
+        th.join();
+}
@@ -0,0 +1,292 @@
+//
+// Filling of closed outlines made of line, quadratic and cubic Bezier segments, such as glyphs.
+//
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include "bezier.hpp"
+#include "parallel.hpp"
+#include "path_fill.hpp"
+
+namespace
+{
+    // Adds to the rows of acc the signed area the line covers in each pixel, less that of the pixel
+    // before it, so that a running sum along a row gives the covered area. The line's x must be in
+    // [0, width]; acc has rows of width + 2 values, since a line at x = width still writes two.
+    void accumulate_line(float* acc, int width, int height, cv::Point2f p0, cv::Point2f p1)
+    {
+        if (p0.y == p1.y)
+            return;
+        float dir = 1;
+        if (p0.y > p1.y)
+        {
+            std::swap(p0, p1);
+            dir = -1;
+        }
+        float dxdy = (p1.x - p0.x) / (p1.y - p0.y);
+        int y0 = std::max(0, (int)std::floor(p0.y));
+        int y1 = std::min(height, (int)std::ceil(p1.y));
+        float x = p0.x + (std::max(p0.y, 0.0f) - p0.y) * dxdy;
+        int stride = width + 2;
+
+        for (int y = y0; y < y1; ++y)
+        {
+            float dy = std::min(y + 1.0f, p1.y) - std::max((float)y, p0.y);
+            float x_next = x + dxdy * dy;
+            float d = dy * dir;
+            float xa = std::min(std::max(std::min(x, x_next), 0.0f), (float)width);
+            float xb = std::min(std::max(std::max(x, x_next), 0.0f), (float)width);
+            x = x_next;
+
+            float* row = acc + y * stride;
+            int ia = (int)std::floor(xa), ib = (int)std::ceil(xb);
+            if (ib <= ia + 1)
+            {
+                // Within one pixel: the part of the pixel right of the line's middle
+                float mid = 0.5f * (xa + xb) - ia;
+                row[ia] += d * (1 - mid);
+                row[ia + 1] += d * mid;
+                continue;
+            }
+            // Across several pixels the covered area grows quadratically in the first and last and
+            // linearly in between
+            float s = 1 / (xb - xa);
+            float f0 = xa - ia;
+            float first = 0.5f * s * (1 - f0) * (1 - f0);
+            float f1 = xb - ib + 1;
+            float last = 0.5f * s * f1 * f1;
+            row[ia] += d * first;
+            if (ib == ia + 2)
+            {
+                row[ia + 1] += d * (1 - first - last);
+            }
+            else
+            {
+                float second = s * (1.5f - f0);
+                row[ia + 1] += d * (second - first);
+                for (int xi = ia + 2; xi < ib - 1; ++xi)
+                    row[xi] += d * s;
+                float before_last = second + (ib - ia - 3) * s;
+                row[ib - 1] += d * (1 - before_last - last);
+            }
+            row[ib] += d * last;
+        }
+    }
+
+    // accumulate_line() for a line anywhere: the parts left of 0 or right of width are moved onto
+    // x = 0 or x = width, where they still change the winding of the pixels to their right
+    void accumulate_edge(float* acc, int width, int height, cv::Point2f p0, cv::Point2f p1)
+    {
+        float splits[4] = {0, 1, 1, 1};
+        int count = 1;
+        float dx = p1.x - p0.x;
+        if (dx != 0)
+        {
+            for (float bound : {0.0f, (float)width})
+            {
+                float t = (bound - p0.x) / dx;
+                if (t > 0 && t < 1)
+                    splits[count++] = t;
+            }
+        }
+        if (count == 3 && splits[1] > splits[2])
+            std::swap(splits[1], splits[2]);
+        splits[count] = 1;
+
+        auto clamped = [&](float t) {
+            cv::Point2f p = p0 + t * (p1 - p0);
+            p.x = std::min(std::max(p.x, 0.0f), (float)width);
+            return p;
+        };
+        for (int i = 0; i < count; ++i)
+            accumulate_line(acc, width, height, clamped(splits[i]), clamped(splits[i + 1]));
+    }
+}
+
+void path::move_to(cv::Point2f point)
+{
+    verbs.push_back(verb::move);
+    points.push_back(point);
+}
+
+void path::line_to(cv::Point2f point)
+{
+    verbs.push_back(verb::line);
+    points.push_back(point);
+}
+
+void path::quad_to(cv::Point2f control, cv::Point2f point)
+{
+    verbs.push_back(verb::quad);
+    points.push_back(control);
+    points.push_back(point);
+}
+
+void path::cubic_to(cv::Point2f control1, cv::Point2f control2, cv::Point2f point)
+{
+    verbs.push_back(verb::cubic);
+    points.push_back(control1);
+    points.push_back(control2);
+    points.push_back(point);
+}
+
+void path_filler::add(const path& outline, fill_rule rule, cv::Vec3b color, float scale, cv::Point2f offset, float tolerance)
+{
+    fills.push_back({rule, color, INT_MAX, INT_MAX, INT_MIN, INT_MIN});
+    auto transform = [&](cv::Point2f p) { return scale * p + offset; };
+
+    // A path that does not start with move_to() starts at the origin
+    cv::Point2f start = transform(cv::Point2f(0, 0)), current = start;
+    const cv::Point2f* points = outline.points.data();
+    auto add_curve = [&](int count) {
+        cv::Point2f control[4] = {current};
+        for (int i = 1; i < count; ++i)
+            control[i] = transform(*points++);
+        polyline.clear();
+        flatten_bezier(control, count, tolerance, polyline);
+        for (cv::Point2f p : polyline)
+        {
+            add_edge(current, p);
+            current = p;
+        }
+    };
+    for (path::verb verb : outline.verbs)
+    {
+        switch (verb)
+        {
+        case path::verb::move:
+            add_edge(current, start);
+            start = current = transform(*points++);
+            break;
+        case path::verb::line:
+            add_curve(2);
+            break;
+        case path::verb::quad:
+            add_curve(3);
+            break;
+        case path::verb::cubic:
+            add_curve(4);
+            break;
+        }
+    }
+    add_edge(current, start);
+
+    // Nothing to fill
+    if (fills.back().x0 > fills.back().x1)
+        fills.pop_back();
+}
+
+void path_filler::add_edge(cv::Point2f p0, cv::Point2f p1)
+{
+    // Horizontal edges change no winding
+    if (p0.y == p1.y)
+        return;
+    fill& f = fills.back();
+    edges.push_back({p0, p1, (int)fills.size() - 1});
+    f.x0 = std::min(f.x0, (int)std::floor(std::min(p0.x, p1.x)));
+    f.y0 = std::min(f.y0, (int)std::floor(std::min(p0.y, p1.y)));
+    f.x1 = std::max(f.x1, (int)std::ceil(std::max(p0.x, p1.x)));
+    f.y1 = std::max(f.y1, (int)std::ceil(std::max(p0.y, p1.y)));
+}
+
+void path_filler::clear()
+{
+    fills.clear();
+    edges.clear();
+}
+
+void path_filler::render(cv::Mat& window, int num_threads)
+{
+    int tiles_x = (window.cols + tile_size - 1) / tile_size;
+    int tiles_y = (window.rows + tile_size - 1) / tile_size;
+    int num_tiles = tiles_x * tiles_y;
+
+    // Calls visit(tile) for the tiles of the edge's rows from the edge's to its path's right end
+    auto for_each_tile = [&](const edge& e, auto&& visit) {
+        int row0 = std::max(0, (int)std::floor(std::min(e.p0.y, e.p1.y)) / tile_size);
+        int row1 = std::min(tiles_y - 1, ((int)std::ceil(std::max(e.p0.y, e.p1.y)) - 1) / tile_size);
+        int col0 = std::max(0, (int)std::floor(std::min(e.p0.x, e.p1.x)) / tile_size);
+        int col1 = std::min(tiles_x - 1, (fills[e.fill].x1 - 1) / tile_size);
+        if (fills[e.fill].x1 <= 0 || std::max(e.p0.y, e.p1.y) <= 0)
+            return;
+        for (int row = row0; row <= row1; ++row)
+            for (int col = col0; col <= col1; ++col)
+                visit(row * tiles_x + col);
+    };
+
+    // Counting pass, prefix sum, then filling pass, as for the segments of stroke_rasterizer
+    tile_start.assign(num_tiles + 1, 0);
+    for (const edge& e : edges)
+        for_each_tile(e, [&](int tile) { ++tile_start[tile + 1]; });
+    for (int t = 0; t < num_tiles; ++t)
+        tile_start[t + 1] += tile_start[t];
+    tile_edges.resize(tile_start[num_tiles]);
+    for (int i = 0; i < (int)edges.size(); ++i)
+        for_each_tile(edges[i], [&](int tile) { tile_edges[tile_start[tile]++] = i; });
+    for (int t = num_tiles; t > 0; --t)
+        tile_start[t] = tile_start[t - 1];
+    tile_start[0] = 0;
+
+    parallel_for(num_tiles, num_threads, [&](int t) { fill_tile(t % tiles_x, t / tiles_x, tiles_x, window); });
+    clear();
+}
+
+void path_filler::fill_tile(int tile_x, int tile_y, int tiles_x, cv::Mat& window) const
+{
+    int tile = tile_y * tiles_x + tile_x;
+    int first = tile_start[tile], last = tile_start[tile + 1];
+    if (first == last)
+        return;
+
+    int origin_x = tile_x * tile_size, origin_y = tile_y * tile_size;
+    cv::Point2f origin(origin_x, origin_y);
+    int width = std::min(tile_size, window.cols - origin_x);
+    int height = std::min(tile_size, window.rows - origin_y);
+    int stride = width + 2;
+    // Every fill leaves the accumulation buffer zeroed behind it
+    std::vector<float> acc(stride * height, 0.0f);
+
+    for (int k = first; k < last;)
+    {
+        int f = edges[tile_edges[k]].fill;
+        for (; k < last && edges[tile_edges[k]].fill == f; ++k)
+        {
+            const edge& e = edges[tile_edges[k]];
+            accumulate_edge(acc.data(), width, height, e.p0 - origin, e.p1 - origin);
+        }
+
+        const fill& fl = fills[f];
+        int c0 = std::max(0, fl.x0 - origin_x), c1 = std::min(width, fl.x1 - origin_x);
+        int r0 = std::max(0, fl.y0 - origin_y), r1 = std::min(height, fl.y1 - origin_y);
+        for (int r = r0; r < r1; ++r)
+        {
+            float* row = &acc[r * stride];
+            float winding = 0;
+            for (int c = c0; c < c1; ++c)
+            {
+                winding += row[c];
+                row[c] = 0;
+                float coverage = std::abs(winding);
+                if (fl.rule == fill_rule::nonzero)
+                {
+                    coverage = std::min(coverage, 1.0f);
+                }
+                else
+                {
+                    coverage = std::fmod(coverage, 2.0f);
+                    coverage = coverage > 1 ? 2 - coverage : coverage;
+                }
+                if (coverage < 1.0f / 512)
+                    continue;
+
+                cv::Vec3b& pixel = window.at<cv::Vec3b>(origin_y + r, origin_x + c);
+                for (int i = 0; i < 3; ++i)
+                    pixel[i] = (unsigned char)(pixel[i] + (fl.color[i] - pixel[i]) * coverage + 0.5f);
+            }
+            // What the path's right end leaves past the last column
+            row[c1] = 0;
+            row[c1 + 1] = 0;
+        }
+    }
+}
@@ -0,0 +1,89 @@
+//
+// Filling of closed outlines made of line, quadratic and cubic Bezier segments, such as glyphs.
+//
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+enum class fill_rule
+{
+    nonzero,
+    even_odd
+};
+
+// Outline of one or more contours. Every contour is closed implicitly from its last point back to
+// the point of its move_to().
+class path
+{
+public:
+    void move_to(cv::Point2f point);
+    void line_to(cv::Point2f point);
+    void quad_to(cv::Point2f control, cv::Point2f point);
+    void cubic_to(cv::Point2f control1, cv::Point2f control2, cv::Point2f point);
+
+    bool empty() const { return verbs.empty(); }
+
+private:
+    friend class path_filler;
+
+    enum class verb
+    {
+        move,
+        line,
+        quad,
+        cubic
+    };
+    std::vector<verb> verbs;
+    std::vector<cv::Point2f> points;
+};
+
+// Fills paths into a window, in the order they are added. Outlines are flattened into line edges
+// when they are added; render() then bins the edges into square tiles of the window, each edge into
+// the tiles of its rows from its own up to the right end of its path, and fills the tiles
+// independently, on as many threads as it is given. Within a tile each path is filled by
+// accumulating the signed area every edge covers in every pixel of its rows; a running sum along
+// each row then gives the winding of every pixel weighted by coverage, which the fill rule turns into
+// the pixel's coverage. Nothing is evaluated per pixel but the running sum, whatever the curves.
+// The coverage is exact in pixels that one edge crosses, and approximate where edges cross each
+// other within a pixel, since overlapping areas are summed rather than intersected.
+class path_filler
+{
+public:
+    static constexpr int tile_size = 64;
+
+    // Queues outline, scaled by scale and then moved by offset, to be filled with color. Its curves
+    // are flattened to within tolerance pixels.
+    void add(const path& outline, fill_rule rule, cv::Vec3b color, float scale = 1.0f,
+             cv::Point2f offset = cv::Point2f(0, 0), float tolerance = 0.25f);
+
+    // Blends the queued paths into the CV_8UC3 window with their coverage and clears the queue
+    void render(cv::Mat& window, int num_threads = 1);
+    void clear();
+
+private:
+    struct edge
+    {
+        cv::Point2f p0, p1;
+        int fill;
+    };
+
+    struct fill
+    {
+        fill_rule rule;
+        cv::Vec3b color;
+        // Pixel bounds of the edges, exclusive at x1 and y1
+        int x0, y0, x1, y1;
+    };
+
+    void add_edge(cv::Point2f p0, cv::Point2f p1);
+    void fill_tile(int tile_x, int tile_y, int tiles_x, cv::Mat& window) const;
+
+    std::vector<fill> fills;
+    std::vector<edge> edges;
+    // Edges of tile t are edges[tile_edges[tile_start[t], tile_start[t + 1])], in the order added
+    std::vector<int> tile_start;
+    std::vector<int> tile_edges;
+    std::vector<cv::Point2f> polyline;
+};